@@ -29,6 +29,16 @@ int main(int argc, char* argv[])
             ("v,vertex-corr", "Path to the vertex correspondence file", cxxopts::value<std::string>())
             ("i,intermediate", "Path to the intermediate directory", cxxopts::value<std::string>(), "(Optional)")
             ("o,output", "Path to save the deformed target mesh to", cxxopts::value<std::string>())
+            ("c,checkpoint", "Path to a checkpoint written after every step, resumed from if it matches", cxxopts::value<std::string>(), "(Optional)")
+            ("solver", "Sparse solver: ldlt, llt, cholmod or cg", cxxopts::value<std::string>()->default_value("ldlt"))
+            ("search", "Closest target vertex search: cgal or flat", cxxopts::value<std::string>()->default_value("cgal"))
+            ("surface-closest", "Snap closest constraints to the closest target surface point instead of the closest target vertex")
+            ("warm-start", "Start each step's iterative solve from the previous step's solution")
+            ("tolerance", "Relative residual of the iterative solver", cxxopts::value<double>()->default_value("1e-10"))
+            ("adaptive", "Ramp the closest weight and stop once the steps at full weight converge, instead of the fixed five steps")
+            ("displacement-threshold", "Adaptive stop when a step's max vertex displacement, relative to the target size, is below this", cxxopts::value<double>()->default_value("0.0005"))
+            ("residual-threshold", "Adaptive stop when a step's RMS closest point distance, relative to the target size, is below this", cxxopts::value<double>()->default_value("0.0005"))
+            ("max-iterations", "Iteration limit of the iterative solver, 0 uses the solver's default", cxxopts::value<int>()->default_value("0"))
             ;
 
     std::string sourceRefPath;
@@ -36,6 +46,15 @@ int main(int argc, char* argv[])
     std::string vertCorrespondencePath;
     std::string outputPath;
     std::string intermediatePath;
+    std::string checkpointPath;
+    LinearSolverType solverType = LinearSolverType::LDLT;
+    bool warmStart = false;
+    bool surfaceClosest = false;
+    auto searchEngine = Search::EngineCGAL;
+    double tolerance = 1e-10;
+    int maxIterations = 0;
+    bool adaptive = false;
+    auto schedule = CorrespondenceSolver::DefaultSchedule();
 
     try
     {
@@ -55,6 +74,31 @@ int main(int argc, char* argv[])
         if (result.count("i")) {
             intermediatePath = result["intermediate"].as<std::string>();
         }
+
+        if (result.count("c")) {
+            checkpointPath = result["checkpoint"].as<std::string>();
+        }
+
+        if (!ParseLinearSolverType(result["solver"].as<std::string>(), solverType))
+        {
+            std::cout << "Unknown solver: " << result["solver"].as<std::string>() << std::endl;
+            exit(1);
+        }
+
+        if (!Search::ParseEngine(result["search"].as<std::string>(), searchEngine))
+        {
+            std::cout << "Unknown search: " << result["search"].as<std::string>() << std::endl;
+            exit(1);
+        }
+
+        warmStart = result.count("warm-start") > 0;
+        surfaceClosest = result.count("surface-closest") > 0;
+        tolerance = result["tolerance"].as<double>();
+        maxIterations = result["max-iterations"].as<int>();
+
+        adaptive = result.count("adaptive") > 0;
+        schedule.displacementThreshold = result["displacement-threshold"].as<double>();
+        schedule.residualThreshold = result["residual-threshold"].as<double>();
     }
     catch (const cxxopts::OptionException& e)
     {
@@ -80,6 +124,21 @@ int main(int argc, char* argv[])
     TIMER_START(CorrespondenceResolver)
 
     CorrespondenceSolver resolver;
+
+    if (!resolver.setSolver(solverType))
+        exit(1);
+
+    resolver.solver().setTolerance(tolerance);
+    resolver.solver().setMaxIterations(maxIterations);
+    resolver.setWarmStart(warmStart);
+    resolver.setSurfaceClosest(surfaceClosest);
+    resolver.setSearchEngine(searchEngine);
+
+    if (adaptive)
+        resolver.setSchedule(schedule);
+
+    resolver.setCheckpoint(checkpointPath);
+
     resolver.setSourceReference(sourceRef);
     resolver.setTargetReference(targetRef);
     resolver.setVertexConstraints(anchorMap);
@@ -0,0 +1,55 @@
+//
+//  FaceGeometry.cpp
+//  Deform
+//
+
+#include "FaceGeometry.h"
+
+void FaceGeometry::build(const Mesh& mesh)
+{
+    const auto numFaces = mesh.n_faces();
+    
+    for (int i = 0; i < 3; i++)
+        _v[i].resize(numFaces);
+    
+    Mesh::VertexHandle vertices[3];
+    
+    for (size_t face = 0; face < numFaces; face++)
+    {
+        FaceVertices(mesh, mesh.face_handle((unsigned int)face), vertices);
+        
+        for (int i = 0; i < 3; i++)
+            _v[i][face] = vertices[i].idx();
+    }
+    
+    copyPositions(mesh);
+}
+
+void FaceGeometry::update(const Mesh& mesh)
+{
+    if (mesh.n_faces() != numFaces() || mesh.n_vertices() != numVertices())
+    {
+        build(mesh);
+        return;
+    }
+    
+    copyPositions(mesh);
+}
+
+void FaceGeometry::copyPositions(const Mesh& mesh)
+{
+    const auto numVertices = mesh.n_vertices();
+    
+    _x.resize(numVertices);
+    _y.resize(numVertices);
+    _z.resize(numVertices);
+    
+    for (size_t i = 0; i < numVertices; i++)
+    {
+        const auto& p = mesh.point(mesh.vertex_handle((unsigned int)i));
+        
+        _x[i] = p[0];
+        _y[i] = p[1];
+        _z[i] = p[2];
+    }
+}
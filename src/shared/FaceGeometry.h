@@ -0,0 +1,47 @@
+//
+//  FaceGeometry.h
+//  Deform
+//
+//  Flat per-face vertex indices and structure-of-arrays vertex positions,
+//  so per-face kernels do not walk the half-edge structure.
+//
+
+#ifndef FaceGeometry_h
+#define FaceGeometry_h
+
+#include "Mesh.h"
+
+#include <vector>
+
+class FaceGeometry
+{
+public:
+    // Copy topology and positions.
+    void build(const Mesh& mesh);
+    
+    // Copy positions only, the mesh must have the topology passed to build.
+    // Rebuilds if the vertex or face count changed.
+    void update(const Mesh& mesh);
+    
+    size_t numVertices() const { return _x.size(); }
+    size_t numFaces() const { return _v[0].size(); }
+    
+    int vertex(size_t face, int corner) const { return _v[corner][face]; }
+    
+    const int* vertices(int corner) const { return _v[corner].data(); }
+    
+    const double* x() const { return _x.data(); }
+    const double* y() const { return _y.data(); }
+    const double* z() const { return _z.data(); }
+    
+private:
+    std::vector<int> _v[3];
+    
+    std::vector<double> _x;
+    std::vector<double> _y;
+    std::vector<double> _z;
+    
+    void copyPositions(const Mesh& mesh);
+};
+
+#endif /* FaceGeometry_h */
@@ -0,0 +1,346 @@
+//
+//  FlatKdTree.cpp
+//  Deform
+//
+
+#include "FlatKdTree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Points per leaf.
+static const int LeafSize = 8;
+
+// Widens normal cones so rounding never prunes a point that faces the query.
+static const double ConeSlack = 1e-6;
+
+// Squared distance from p to the box [min, max], zero inside.
+inline double BoxDistanceSqr(const Vector3& p, const Vector3& min, const Vector3& max)
+{
+    return (min - p).cwiseMax(p - max).cwiseMax(0.0).squaredNorm();
+}
+
+// Orders hits by distance, ties by index, so results do not depend on the tree layout.
+inline bool CloserHit(const FlatKdTree::Hit& a, const FlatKdTree::Hit& b)
+{
+    return a.distanceSqr < b.distanceSqr || (a.distanceSqr == b.distanceSqr && a.idx < b.idx);
+}
+
+// Cone around the mean direction of the normals of order[start, start + count).
+// The cutoff is -sin(angle), or -2 to never prune when the cone is a half space
+// or wider. Zero normals fail every facing test and are left out.
+inline void NormalCone(const std::vector<Vector3>& normals, const std::vector<int>& order, int start, int count, Vector3& axis, double& cutoff)
+{
+    axis = Vector3::Zero();
+    cutoff = -2.0;
+    
+    for (int i = start; i < start + count; i++)
+    {
+        const auto& normal = normals[order[i]];
+        const auto length = normal.norm();
+        
+        if (length > 0.0)
+            axis += normal / length;
+    }
+    
+    const auto axisLength = axis.norm();
+    
+    if (axisLength <= 0.0)
+        return;
+    
+    axis /= axisLength;
+    
+    auto minCos = 1.0;
+    
+    for (int i = start; i < start + count; i++)
+    {
+        const auto& normal = normals[order[i]];
+        const auto length = normal.norm();
+        
+        if (length > 0.0)
+            minCos = std::min(minCos, axis.dot(normal) / length);
+    }
+    
+    const auto angle = std::acos(std::max(-1.0, minCos)) + ConeSlack;
+    
+    if (angle < M_PI / 2)
+        cutoff = -std::sin(angle);
+}
+
+void FlatKdTree::build(const std::vector<Vector3>& points, const std::vector<Vector3>& normals, const std::vector<size_t>& keys)
+{
+    clear();
+    
+    const auto numPoints = (int)keys.size();
+    
+    std::vector<int> order(numPoints);
+    for (int i = 0; i < numPoints; i++)
+        order[i] = (int)keys[i];
+    
+    _nodes.reserve(std::max(1, 2 * numPoints / LeafSize));
+    
+    if (numPoints > 0)
+        buildNode(points, normals, order, 0, numPoints);
+    
+    // Leaves cover contiguous runs of the final order.
+    _keys = order;
+    
+    _x.resize(numPoints);
+    _y.resize(numPoints);
+    _z.resize(numPoints);
+    
+    for (int i = 0; i < numPoints; i++)
+    {
+        const auto& point = points[order[i]];
+        
+        _x[i] = point[0];
+        _y[i] = point[1];
+        _z[i] = point[2];
+    }
+    
+    if (normals.empty())
+        return;
+    
+    _nx.resize(numPoints);
+    _ny.resize(numPoints);
+    _nz.resize(numPoints);
+    
+    for (int i = 0; i < numPoints; i++)
+    {
+        const auto& normal = normals[order[i]];
+        
+        _nx[i] = normal[0];
+        _ny[i] = normal[1];
+        _nz[i] = normal[2];
+    }
+}
+
+void FlatKdTree::clear()
+{
+    _nodes.clear();
+    
+    _x.clear();
+    _y.clear();
+    _z.clear();
+    
+    _nx.clear();
+    _ny.clear();
+    _nz.clear();
+    
+    _keys.clear();
+}
+
+int FlatKdTree::buildNode(const std::vector<Vector3>& points, const std::vector<Vector3>& normals, std::vector<int>& order, int start, int count)
+{
+    const auto index = (int)_nodes.size();
+    
+    _nodes.push_back(Node());
+    
+    Vector3 min = Vector3::Constant(std::numeric_limits<double>::max());
+    Vector3 max = Vector3::Constant(-std::numeric_limits<double>::max());
+    
+    for (int i = start; i < start + count; i++)
+    {
+        min = min.cwiseMin(points[order[i]]);
+        max = max.cwiseMax(points[order[i]]);
+    }
+    
+    _nodes[index].min = min;
+    _nodes[index].max = max;
+    
+    if (normals.empty())
+    {
+        _nodes[index].axis = Vector3::Zero();
+        _nodes[index].coneCutoff = -2.0;
+    }
+    else
+    {
+        NormalCone(normals, order, start, count, _nodes[index].axis, _nodes[index].coneCutoff);
+    }
+    
+    if (count <= LeafSize)
+    {
+        _nodes[index].start = start;
+        _nodes[index].count = count;
+        
+        return index;
+    }
+    
+    // Median split along the longest axis.
+    int axis;
+    (max - min).maxCoeff(&axis);
+    
+    const auto half = count / 2;
+    
+    std::nth_element(order.begin() + start, order.begin() + start + half, order.begin() + start + count,
+    [&points, axis]
+    (int a, int b)
+    {
+        return points[a][axis] < points[b][axis];
+    });
+    
+    buildNode(points, normals, order, start, half);
+    
+    const auto right = buildNode(points, normals, order, start + half, count - half);
+    
+    _nodes[index].start = right;
+    _nodes[index].count = 0;
+    
+    return index;
+}
+
+template<typename Visit>
+void FlatKdTree::search(const Vector3& p, const Vector3& n, double& boundSqr, size_t* visited, Visit visit) const
+{
+    if (_nodes.empty())
+        return;
+    
+    const auto useNormal = !_nx.empty();
+    const auto useCones = useNormal && _normalCones;
+    
+    const auto nLength = n.norm();
+    
+    size_t numVisited = 0;
+    
+    // Depth is logarithmic in the point count, 64 levels covers any mesh.
+    int stack[64];
+    int size = 0;
+    
+    stack[size++] = 0;
+    
+    while (size > 0)
+    {
+        const auto index = stack[--size];
+        const auto& node = _nodes[index];
+        
+        if (BoxDistanceSqr(p, node.min, node.max) > boundSqr)
+            continue;
+        
+        if (useCones && node.axis.dot(n) <= node.coneCutoff * nLength)
+            continue;
+        
+        numVisited++;
+        
+        if (node.count > 0)
+        {
+            for (int i = node.start; i < node.start + node.count; i++)
+            {
+                if (useNormal && (_nx[i] * n[0] + _ny[i] * n[1] + _nz[i] * n[2]) <= 0.0)
+                    continue;
+                
+                const auto dx = _x[i] - p[0];
+                const auto dy = _y[i] - p[1];
+                const auto dz = _z[i] - p[2];
+                
+                const auto distanceSqr = dx * dx + dy * dy + dz * dz;
+                
+                if (distanceSqr <= boundSqr)
+                    visit(i, distanceSqr);
+            }
+            
+            continue;
+        }
+        
+        // Visit the nearer child first, it is pushed last.
+        const auto left = index + 1;
+        const auto right = node.start;
+        
+        const auto leftDistance = BoxDistanceSqr(p, _nodes[left].min, _nodes[left].max);
+        const auto rightDistance = BoxDistanceSqr(p, _nodes[right].min, _nodes[right].max);
+        
+        if (leftDistance <= rightDistance)
+        {
+            stack[size++] = right;
+            stack[size++] = left;
+        }
+        else
+        {
+            stack[size++] = left;
+            stack[size++] = right;
+        }
+    }
+    
+    if (visited != nullptr)
+        *visited += numVisited;
+}
+
+bool FlatKdTree::nearest(const Vector3& p, const Vector3& n, Hit& hit, size_t* visited) const
+{
+    hit.idx = -1;
+    hit.distanceSqr = std::numeric_limits<double>::max();
+    
+    auto boundSqr = hit.distanceSqr;
+    
+    search(p, n, boundSqr, visited,
+    [this, &hit, &boundSqr]
+    (int i, double distanceSqr)
+    {
+        const Hit candidate = {_keys[i], distanceSqr};
+        
+        if (hit.idx == -1 || CloserHit(candidate, hit))
+        {
+            hit = candidate;
+            boundSqr = distanceSqr;
+        }
+    });
+    
+    return hit.idx != -1;
+}
+
+void FlatKdTree::nearest(const Vector3& p, const Vector3& n, int k, Hits& hits, size_t* visited) const
+{
+    nearest(p, n, k, std::numeric_limits<double>::infinity(), hits, visited);
+}
+
+void FlatKdTree::nearest(const Vector3& p, const Vector3& n, int k, double radius, Hits& hits, size_t* visited) const
+{
+    hits.clear();
+    
+    if (k <= 0)
+        return;
+    
+    auto boundSqr = radius * radius;
+    
+    // Max heap of the k closest so far, its top bounds the search once full.
+    search(p, n, boundSqr, visited,
+    [this, k, &hits, &boundSqr]
+    (int i, double distanceSqr)
+    {
+        const Hit candidate = {_keys[i], distanceSqr};
+        
+        if ((int)hits.size() == k)
+        {
+            if (!CloserHit(candidate, hits.front()))
+                return;
+            
+            std::pop_heap(hits.begin(), hits.end(), CloserHit);
+            hits.back() = candidate;
+        }
+        else
+        {
+            hits.push_back(candidate);
+        }
+        
+        std::push_heap(hits.begin(), hits.end(), CloserHit);
+        
+        if ((int)hits.size() == k)
+            boundSqr = hits.front().distanceSqr;
+    });
+    
+    std::sort_heap(hits.begin(), hits.end(), CloserHit);
+}
+
+void FlatKdTree::range(const Vector3& p, const Vector3& n, double radius, Hits& hits, size_t* visited) const
+{
+    hits.clear();
+    
+    auto boundSqr = radius * radius;
+    
+    search(p, n, boundSqr, visited,
+    [this, &hits]
+    (int i, double distanceSqr)
+    {
+        hits.push_back(Hit{_keys[i], distanceSqr});
+    });
+}
@@ -0,0 +1,95 @@
+//
+//  FlatKdTree.h
+//  Deform
+//
+//  KD-tree over points with optional normals. Nodes are stored depth first
+//  in one array, so the left child of a node is the next node, and leaves
+//  reference contiguous runs of structure-of-arrays points and normals.
+//  With normals, every node also bounds the normals below it by a cone, so
+//  subtrees that entirely face away from the query are skipped. Queries
+//  allocate nothing beyond their results and are safe to run from several
+//  threads.
+//
+
+#ifndef FlatKdTree_h
+#define FlatKdTree_h
+
+#include "Matrix.h"
+
+#include <vector>
+
+class FlatKdTree
+{
+public:
+    struct Hit
+    {
+        int idx;
+        double distanceSqr;
+    };
+    
+    typedef std::vector<Hit> Hits;
+    
+    // Indexes points[key] for every key in keys. With normals, queries skip
+    // points whose normal does not face the query normal, (normal . n) <= 0.
+    void build(const std::vector<Vector3>& points, const std::vector<Vector3>& normals, const std::vector<size_t>& keys);
+    
+    void clear();
+    
+    size_t size() const { return _keys.size(); }
+    
+    // Normal cone pruning, on by default. Results are the same either way.
+    void setNormalCones(bool normalCones) { _normalCones = normalCones; }
+    
+    // Queries add the number of nodes they enter to visited, when given.
+    bool nearest(const Vector3& p, const Vector3& n, Hit& hit, size_t* visited = nullptr) const;
+    
+    // Up to k nearest points, sorted by distance.
+    void nearest(const Vector3& p, const Vector3& n, int k, Hits& hits, size_t* visited = nullptr) const;
+    
+    // Up to k nearest points within radius of p, sorted by distance.
+    void nearest(const Vector3& p, const Vector3& n, int k, double radius, Hits& hits, size_t* visited = nullptr) const;
+    
+    // Every point within radius of p, in tree order.
+    void range(const Vector3& p, const Vector3& n, double radius, Hits& hits, size_t* visited = nullptr) const;
+
+private:
+    struct Node
+    {
+        Vector3 min;
+        Vector3 max;
+        
+        // Every normal below lies within the cone around axis, so the subtree
+        // faces away from n when (axis . n) <= coneCutoff * |n|.
+        Vector3 axis;
+        double coneCutoff;
+        
+        // Leaves have count > 0 and cover points [start, start + count).
+        // Inner nodes have count == 0 and their right child at start.
+        int start;
+        int count;
+    };
+    
+    std::vector<Node> _nodes;
+    
+    std::vector<double> _x;
+    std::vector<double> _y;
+    std::vector<double> _z;
+    
+    // Empty when built without normals.
+    std::vector<double> _nx;
+    std::vector<double> _ny;
+    std::vector<double> _nz;
+    
+    std::vector<int> _keys;
+    
+    bool _normalCones = true;
+    
+    int buildNode(const std::vector<Vector3>& points, const std::vector<Vector3>& normals, std::vector<int>& order, int start, int count);
+    
+    // Calls visit(i, distanceSqr) for every point i passing the normal test
+    // within boundSqr of p, visit may shrink boundSqr.
+    template<typename Visit>
+    void search(const Vector3& p, const Vector3& n, double& boundSqr, size_t* visited, Visit visit) const;
+};
+
+#endif /* FlatKdTree_h */
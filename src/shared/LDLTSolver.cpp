@@ -0,0 +1,72 @@
+//
+//  LDLTSolver.cpp
+//  Deform
+//
+
+#include "LDLTSolver.h"
+
+#include "Serialize.h"
+
+// SimplicialCholeskyBase redeclares m_isInitialized private, so it is reached
+// through a member pointer taken in a class derived from SparseSolverBase.
+struct SolverInitialized : Eigen::SparseSolverBase<Eigen::SimplicialLDLT<SparseMatrix>>
+{
+    static void set(Eigen::SparseSolverBase<Eigen::SimplicialLDLT<SparseMatrix>>& solver, bool initialized)
+    {
+        solver.*(&SolverInitialized::m_isInitialized) = initialized;
+    }
+};
+
+bool LDLTSolver::write(std::ostream& out) const
+{
+    if (!m_factorizationIsOk || m_info != Eigen::Success)
+        return false;
+    
+    return WriteSparse(out, m_matrix)
+        && WriteArray(out, m_diag.data(), m_diag.size())
+        && WriteArray(out, m_parent.data(), m_parent.size())
+        && WriteArray(out, m_nonZerosPerCol.data(), m_nonZerosPerCol.size())
+        && WriteArray(out, m_P.indices().data(), m_P.size());
+}
+
+bool LDLTSolver::read(std::istream& in, size_t size)
+{
+    std::vector<double> diag;
+    std::vector<StorageIndex> parent, nonZerosPerCol, perm;
+    
+    // Nothing is usable until the whole factorization has been read and checked.
+    SolverInitialized::set(*this, false);
+    m_analysisIsOk = false;
+    m_factorizationIsOk = false;
+    m_info = Eigen::InvalidInput;
+    
+    if (!ReadSparse(in, m_matrix, (int64_t)size, (int64_t)size))
+        return false;
+    
+    if (!ReadArray(in, diag, size) || !ReadArray(in, parent, size) || !ReadArray(in, nonZerosPerCol, size) || !ReadArray(in, perm, size))
+        return false;
+    
+    if (diag.size() != size || parent.size() != size || nonZerosPerCol.size() != size || (!perm.empty() && perm.size() != size))
+        return false;
+    
+    for (auto index : perm)
+    {
+        if (index < 0 || (size_t)index >= size)
+            return false;
+    }
+    
+    m_diag = Eigen::Map<const VectorType>(diag.data(), size);
+    m_parent = Eigen::Map<const VectorI>(parent.data(), size);
+    m_nonZerosPerCol = Eigen::Map<const VectorI>(nonZerosPerCol.data(), size);
+    
+    m_P.resize(perm.size());
+    m_P.indices() = Eigen::Map<const VectorI>(perm.data(), perm.size());
+    m_Pinv = m_P.inverse();
+    
+    m_info = Eigen::Success;
+    SolverInitialized::set(*this, true);
+    m_analysisIsOk = true;
+    m_factorizationIsOk = true;
+    
+    return true;
+}
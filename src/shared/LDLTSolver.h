@@ -0,0 +1,28 @@
+//
+//  LDLTSolver.h
+//  Deform
+//
+//  SimplicialLDLT with access to its factored state, so a factorization
+//  can be written to disk and restored without calling compute(). read
+//  sets the state flags of SimplicialCholeskyBase and SparseSolverBase
+//  directly, as laid out in Eigen 3.3 and 3.4.
+//
+
+#ifndef LDLTSolver_h
+#define LDLTSolver_h
+
+#include "Matrix.h"
+
+#include <istream>
+#include <ostream>
+
+class LDLTSolver : public Eigen::SimplicialLDLT<SparseMatrix>
+{
+public:
+    bool write(std::ostream& out) const;
+    
+    // Fails unless the stored factorization is size x size.
+    bool read(std::istream& in, size_t size);
+};
+
+#endif /* LDLTSolver_h */
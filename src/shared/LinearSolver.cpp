@@ -0,0 +1,247 @@
+//
+//  LinearSolver.cpp
+//  Deform
+//
+
+#include "LinearSolver.h"
+
+#include "LDLTSolver.h"
+
+#include <Eigen/IterativeLinearSolvers>
+
+#ifdef DEFORM_USE_CHOLMOD
+#include <Eigen/CholmodSupport>
+#endif
+
+#include <algorithm>
+#include <cctype>
+
+namespace
+{
+    template<typename Solver, LinearSolverType Type>
+    class DirectSolver : public LinearSolver
+    {
+    public:
+        LinearSolverType type() const override
+        {
+            return Type;
+        }
+        
+        void analyzePattern(const SparseMatrix& m) override
+        {
+            _solver.analyzePattern(m);
+        }
+        
+        void factorize(const SparseMatrix& m) override
+        {
+            _solver.factorize(m);
+        }
+        
+        MatrixX solve(const MatrixX& b) const override
+        {
+            return _solver.solve(b);
+        }
+        
+        Eigen::ComputationInfo info() const override
+        {
+            return _solver.info();
+        }
+        
+    protected:
+        Solver _solver;
+    };
+    
+    class LDLTLinearSolver : public DirectSolver<LDLTSolver, LinearSolverType::LDLT>
+    {
+    public:
+        bool serializable() const override
+        {
+            return true;
+        }
+        
+        bool write(std::ostream& out) const override
+        {
+            return _solver.write(out);
+        }
+        
+        bool read(std::istream& in, size_t size) override
+        {
+            return _solver.read(in, size);
+        }
+    };
+    
+    class CGLinearSolver : public LinearSolver
+    {
+    public:
+        LinearSolverType type() const override
+        {
+            return LinearSolverType::CG;
+        }
+        
+        // The solver only references its matrix, which callers do not keep alive.
+        void analyzePattern(const SparseMatrix& m) override
+        {
+            _matrix = m;
+            _solver.analyzePattern(_matrix);
+        }
+        
+        // Computes the incomplete Cholesky preconditioner.
+        void factorize(const SparseMatrix& m) override
+        {
+            _matrix = m;
+            _solver.factorize(_matrix);
+        }
+        
+        MatrixX solve(const MatrixX& b) const override
+        {
+            configure();
+            
+            return _solver.solve(b);
+        }
+        
+        MatrixX solveWithGuess(const MatrixX& b, const MatrixX& guess) const override
+        {
+            configure();
+            
+            return _solver.solveWithGuess(b, guess);
+        }
+        
+        Eigen::ComputationInfo info() const override
+        {
+            return _solver.info();
+        }
+        
+        int iterations() const override
+        {
+            return (int)_solver.iterations();
+        }
+        
+    private:
+        // Both triangles are passed so the product runs multithreaded under OpenMP.
+        typedef Eigen::ConjugateGradient<SparseMatrix, Eigen::Lower | Eigen::Upper, Eigen::IncompleteCholesky<double>> Solver;
+        
+        SparseMatrix _matrix;
+        
+        mutable Solver _solver;
+        
+        void configure() const
+        {
+            _solver.setTolerance(_tolerance);
+            
+            if (_maxIterations > 0)
+                _solver.setMaxIterations(_maxIterations);
+        }
+    };
+}
+
+const char* LinearSolverName(LinearSolverType type)
+{
+    switch (type)
+    {
+        case LinearSolverType::LDLT:
+            return "ldlt";
+        case LinearSolverType::LLT:
+            return "llt";
+        case LinearSolverType::Cholmod:
+            return "cholmod";
+        case LinearSolverType::CG:
+            return "cg";
+    }
+    
+    return "unknown";
+}
+
+bool ParseLinearSolverType(const std::string& name, LinearSolverType& type)
+{
+    std::string lower = name;
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+    
+    for (auto t : {LinearSolverType::LDLT, LinearSolverType::LLT, LinearSolverType::Cholmod, LinearSolverType::CG})
+    {
+        if (lower == LinearSolverName(t))
+        {
+            type = t;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+bool LinearSolverAvailable(LinearSolverType type)
+{
+#ifndef DEFORM_USE_CHOLMOD
+    if (type == LinearSolverType::Cholmod)
+        return false;
+#endif
+    
+    return true;
+}
+
+std::unique_ptr<LinearSolver> LinearSolver::Create(LinearSolverType type)
+{
+    switch (type)
+    {
+        case LinearSolverType::LDLT:
+            return std::unique_ptr<LinearSolver>(new LDLTLinearSolver());
+        case LinearSolverType::LLT:
+            return std::unique_ptr<LinearSolver>(new DirectSolver<Eigen::SimplicialLLT<SparseMatrix>, LinearSolverType::LLT>());
+#ifdef DEFORM_USE_CHOLMOD
+        case LinearSolverType::Cholmod:
+            return std::unique_ptr<LinearSolver>(new DirectSolver<Eigen::CholmodSupernodalLLT<SparseMatrix>, LinearSolverType::Cholmod>());
+#endif
+        case LinearSolverType::CG:
+            return std::unique_ptr<LinearSolver>(new CGLinearSolver());
+        default:
+            return nullptr;
+    }
+}
+
+LinearSolver::LinearSolver()
+: _tolerance(1e-10)
+, _maxIterations(0)
+{
+}
+
+void LinearSolver::compute(const SparseMatrix& m)
+{
+    analyzePattern(m);
+    
+    if (info() == Eigen::Success)
+        factorize(m);
+}
+
+MatrixX LinearSolver::solveWithGuess(const MatrixX& b, const MatrixX& /*guess*/) const
+{
+    return solve(b);
+}
+
+int LinearSolver::iterations() const
+{
+    return 0;
+}
+
+void LinearSolver::setTolerance(double tolerance)
+{
+    _tolerance = tolerance;
+}
+
+void LinearSolver::setMaxIterations(int iterations)
+{
+    _maxIterations = iterations;
+}
+
+bool LinearSolver::serializable() const
+{
+    return false;
+}
+
+bool LinearSolver::write(std::ostream& /*out*/) const
+{
+    return false;
+}
+
+bool LinearSolver::read(std::istream& /*in*/, size_t /*size*/)
+{
+    return false;
+}
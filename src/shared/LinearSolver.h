@@ -0,0 +1,81 @@
+//
+//  LinearSolver.h
+//  Deform
+//
+//  Runtime selectable sparse solvers for the symmetric normal equations
+//  built by TransferSolver and CorrespondenceSolver.
+//
+
+#ifndef LinearSolver_h
+#define LinearSolver_h
+
+#include "Matrix.h"
+
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+
+enum class LinearSolverType
+{
+    LDLT,       // Eigen SimplicialLDLT, supports factorization caching
+    LLT,        // Eigen SimplicialLLT
+    Cholmod,    // CHOLMOD supernodal LLT, multithreaded through BLAS, requires DEFORM_USE_CHOLMOD
+    CG          // Conjugate gradient with an incomplete Cholesky preconditioner
+};
+
+const char* LinearSolverName(LinearSolverType type);
+
+// Accepts the names returned by LinearSolverName, case insensitive.
+bool ParseLinearSolverType(const std::string& name, LinearSolverType& type);
+
+// Whether the solver was compiled in.
+bool LinearSolverAvailable(LinearSolverType type);
+
+class LinearSolver
+{
+public:
+    // Returns nullptr if the solver was not compiled in.
+    static std::unique_ptr<LinearSolver> Create(LinearSolverType type);
+    
+    virtual ~LinearSolver() {}
+    
+    virtual LinearSolverType type() const = 0;
+    
+    // Symbolic analysis, only depends on the sparsity pattern of m.
+    virtual void analyzePattern(const SparseMatrix& m) = 0;
+    
+    // Numeric factorization of a matrix with the analyzed pattern.
+    virtual void factorize(const SparseMatrix& m) = 0;
+    
+    void compute(const SparseMatrix& m);
+    
+    virtual MatrixX solve(const MatrixX& b) const = 0;
+    
+    // Iterative solvers start from guess, direct solvers ignore it.
+    virtual MatrixX solveWithGuess(const MatrixX& b, const MatrixX& guess) const;
+    
+    virtual Eigen::ComputationInfo info() const = 0;
+    
+    // Iterations of the last solve, 0 for direct solvers.
+    virtual int iterations() const;
+    
+    // Relative residual and iteration limit of iterative solvers,
+    // a limit <= 0 uses the solver's default.
+    void setTolerance(double tolerance);
+    void setMaxIterations(int iterations);
+    
+    // Whether write and read can persist the factorization. read fails
+    // unless the stored system has size unknowns.
+    virtual bool serializable() const;
+    virtual bool write(std::ostream& out) const;
+    virtual bool read(std::istream& in, size_t size);
+    
+protected:
+    LinearSolver();
+    
+    double _tolerance;
+    int _maxIterations;
+};
+
+#endif /* LinearSolver_h */
@@ -0,0 +1,102 @@
+//
+//  NormalEquations.cpp
+//  Deform
+//
+
+#include "NormalEquations.h"
+
+#include <algorithm>
+
+void BuildNormalPattern(std::vector<std::vector<unsigned int>>& adjacency, int stride, SparseMatrix& m)
+{
+    const auto numNodes = adjacency.size();
+    const auto size = (Eigen::Index)(numNodes * stride);
+    
+    size_t nonZeros = 0;
+    
+    for (auto& adj : adjacency)
+    {
+        std::sort(adj.begin(), adj.end());
+        adj.erase(std::unique(adj.begin(), adj.end()), adj.end());
+        
+        nonZeros += adj.size() * stride;
+    }
+    
+    m.resize(size, size);
+    m.resizeNonZeros((Eigen::Index)nonZeros);
+    
+    auto outer = m.outerIndexPtr();
+    auto inner = m.innerIndexPtr();
+    
+    SparseMatrix::StorageIndex offset = 0;
+    
+    for (size_t node = 0; node < numNodes; node++)
+    {
+        const auto& adj = adjacency[node];
+        
+        for (int c = 0; c < stride; c++)
+        {
+            outer[node * stride + c] = offset;
+            
+            for (auto other : adj)
+                inner[offset++] = (SparseMatrix::StorageIndex)(other * stride + c);
+        }
+    }
+    
+    outer[size] = offset;
+    
+    std::fill(m.valuePtr(), m.valuePtr() + nonZeros, 0.0);
+}
+
+void GroupNormalBlocks(const std::vector<std::vector<unsigned int>>& itemNodes, size_t numNodes, std::vector<std::vector<unsigned int>>& groups)
+{
+    groups.clear();
+    
+    // Groups of the items already placed on each node.
+    std::vector<std::vector<unsigned int>> nodeGroups(numNodes);
+    
+    // taken[group] == item + 1 when the group already touches a node of item.
+    std::vector<size_t> taken;
+    
+    for (size_t item = 0; item < itemNodes.size(); item++)
+    {
+        for (auto node : itemNodes[item])
+        {
+            for (auto group : nodeGroups[node])
+                taken[group] = item + 1;
+        }
+        
+        unsigned int group = 0;
+        while (group < taken.size() && taken[group] == item + 1)
+            group++;
+        
+        if (group == groups.size())
+        {
+            groups.emplace_back();
+            taken.push_back(0);
+        }
+        
+        groups[group].push_back((unsigned int)item);
+        
+        for (auto node : itemNodes[item])
+            nodeGroups[node].push_back(group);
+    }
+}
+
+void ReplicateNormalCoordinate(SparseMatrix& m, int stride)
+{
+    const auto numNodes = m.cols() / stride;
+    
+    const auto outer = m.outerIndexPtr();
+    const auto values = m.valuePtr();
+    
+    // Every coordinate column of a node has the same entries in the same order.
+    for (Eigen::Index node = 0; node < numNodes; node++)
+    {
+        const auto begin = outer[node * stride];
+        const auto end = outer[node * stride + 1];
+        
+        for (int c = 1; c < stride; c++)
+            std::copy(values + begin, values + end, values + outer[node * stride + c]);
+    }
+}
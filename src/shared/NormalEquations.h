@@ -0,0 +1,61 @@
+//
+//  NormalEquations.h
+//  Deform
+//
+//  Direct assembly of A^T A from local blocks, without building A.
+//  Unknowns are grouped into nodes of `stride` coordinates, node n owns
+//  columns [n * stride, n * stride + stride), and only equal coordinates
+//  of two nodes are coupled.
+//
+
+#ifndef NormalEquations_h
+#define NormalEquations_h
+
+#include "Matrix.h"
+
+#include <vector>
+
+// Builds the compressed, zero-valued pattern of A^T A.
+// adjacency[n] lists the nodes coupled to node n, it is sorted and made unique in place.
+void BuildNormalPattern(std::vector<std::vector<unsigned int>>& adjacency, int stride, SparseMatrix& m);
+
+// Adds block(i, j) at (indices[i] + c, indices[j] + c) for the single coordinate c.
+// indices are column indices of coordinate 0, entries of (unsigned int)-1 are skipped.
+// The entries must already be in the pattern of m.
+template<int N>
+void AddNormalBlock(SparseMatrix& m, const unsigned int* indices, const Eigen::Matrix<double, N, N>& block, int stride, int c)
+{
+    for (int j = 0; j < N; j++)
+    {
+        if (indices[j] == (unsigned int)-1)
+            continue;
+        
+        for (int i = 0; i < N; i++)
+        {
+            if (indices[i] == (unsigned int)-1)
+                continue;
+            
+            m.coeffRef(indices[i] + c, indices[j] + c) += block(i, j);
+        }
+    }
+}
+
+// Adds block(i, j) at (indices[i] + c, indices[j] + c) for every coordinate c.
+template<int N>
+void AddNormalBlock(SparseMatrix& m, const unsigned int* indices, const Eigen::Matrix<double, N, N>& block, int stride)
+{
+    for (int c = 0; c < stride; c++)
+        AddNormalBlock<N>(m, indices, block, stride, c);
+}
+
+// Greedily groups items so that no two items of a group share a node, where
+// itemNodes[i] lists the nodes item i adds blocks to. The items of one group
+// write disjoint columns of A^T A and disjoint rows of A^T c, so a group can
+// be added in parallel with the same result for any thread count.
+void GroupNormalBlocks(const std::vector<std::vector<unsigned int>>& itemNodes, size_t numNodes, std::vector<std::vector<unsigned int>>& groups);
+
+// Copies the values of coordinate 0 to every other coordinate, for systems
+// whose coordinates share the same blocks. m must come from BuildNormalPattern.
+void ReplicateNormalCoordinate(SparseMatrix& m, int stride);
+
+#endif /* NormalEquations_h */
@@ -0,0 +1,113 @@
+//
+//  Parallel.h
+//  Deform
+//
+//  Static-partition parallel loops. Each index is handled by exactly one
+//  thread and the partition only depends on the count and thread count,
+//  so per-index outputs are deterministic.
+//
+
+#ifndef Parallel_h
+#define Parallel_h
+
+#include <algorithm>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Number of threads to use for a requested count, <= 0 selects all cores.
+inline int ThreadCount(int requested)
+{
+    if (requested > 0)
+        return requested;
+    
+    return std::max(1, (int)std::thread::hardware_concurrency());
+}
+
+// Calls op(begin, end, threadId) on contiguous ranges covering [0, count).
+template<typename Op>
+void ParallelRanges(size_t count, int threads, Op op)
+{
+    const auto numThreads = (size_t)std::min<size_t>(ThreadCount(threads), std::max<size_t>(1, count));
+    
+    if (numThreads <= 1)
+    {
+        op((size_t)0, count, 0);
+        return;
+    }
+    
+    const auto chunk = (count + numThreads - 1) / numThreads;
+    
+    std::vector<std::thread> pool;
+    
+    for (size_t t = 0, begin = 0; t < numThreads && begin < count; t++, begin += chunk)
+    {
+        const auto end = std::min(count, begin + chunk);
+        
+        pool.push_back(std::thread(op, begin, end, (int)t));
+    }
+    
+    for (auto& thread : pool)
+        thread.join();
+}
+
+// Calls op(i) for every i in [0, count).
+template<typename Op>
+void ParallelFor(size_t count, int threads, Op op)
+{
+    ParallelRanges(count, threads,
+    [&op]
+    (size_t begin, size_t end, int /*threadId*/)
+    {
+        for (auto i = begin; i < end; i++)
+            op(i);
+    });
+}
+
+// Sorts values by less, contiguous ranges are sorted in parallel and then merged pairwise.
+template<typename T, typename Less>
+void ParallelSort(std::vector<T>& values, int threads, Less less)
+{
+    typedef std::pair<size_t, size_t> Range;
+    
+    std::vector<Range> ranges(ThreadCount(threads), Range(values.size(), values.size()));
+    
+    ParallelRanges(values.size(), threads,
+    [&values, &less, &ranges]
+    (size_t begin, size_t end, int threadId)
+    {
+        std::sort(values.begin() + begin, values.begin() + end, less);
+        
+        ranges[threadId] = Range(begin, end);
+    });
+    
+    // Threads beyond the number of ranges leave their entry empty.
+    ranges.erase(std::remove_if(ranges.begin(), ranges.end(),
+    []
+    (const Range& range)
+    {
+        return range.first == range.second;
+    }), ranges.end());
+    
+    while (ranges.size() > 1)
+    {
+        std::vector<Range> merged;
+        
+        for (size_t i = 0; i < ranges.size(); i += 2)
+        {
+            if (i + 1 == ranges.size())
+            {
+                merged.push_back(ranges[i]);
+                continue;
+            }
+            
+            std::inplace_merge(values.begin() + ranges[i].first, values.begin() + ranges[i + 1].first, values.begin() + ranges[i + 1].second, less);
+            
+            merged.push_back(Range(ranges[i].first, ranges[i + 1].second));
+        }
+        
+        ranges.swap(merged);
+    }
+}
+
+#endif /* Parallel_h */
@@ -1,6 +1,11 @@
 #include "Search.h"
+#include "Parallel.h"
+#include "Util.h"
 
-//std::vector<Search::PointContainerVector::value_type> Search::PointContainerVector::_temp;
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
 
 inline Mesh::Point uvCentroid(MeshPtr mesh, const Mesh::FaceHandle& face)
 {
@@ -31,13 +36,111 @@ inline Mesh::Point uv(MeshPtr mesh, const Mesh::VertexHandle& vert)
     return Mesh::Point(tc[0], tc[1], 0);
 }
 
-Search::Search()
-: _ppMap(_points)
-, _distance(_ppMap)
+// Spreads the low 10 bits of v to every third bit.
+inline uint32_t SpreadBits(uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    
+    return v;
+}
+
+// Indices of points sorted along a Morton curve through their bounds.
+inline std::vector<int> MortonOrder(const std::vector<Mesh::Point>& points)
+{
+    const auto numPoints = points.size();
+    
+    std::vector<int> order(numPoints);
+    
+    if (numPoints == 0)
+        return order;
+    
+    auto min = points[0];
+    auto max = points[0];
+    
+    for (const auto& point : points)
+    {
+        min.minimize(point);
+        max.maximize(point);
+    }
+    
+    Mesh::Point scale;
+    for (auto i = 0; i < 3; i++)
+        scale[i] = max[i] > min[i] ? 1023.0 / (max[i] - min[i]) : 0.0;
+    
+    std::vector<std::pair<uint32_t, int>> codes(numPoints);
+    
+    for (size_t i = 0; i < numPoints; i++)
+    {
+        const auto cell = (points[i] - min) * scale;
+        
+        codes[i].first = SpreadBits((uint32_t)cell[0]) | (SpreadBits((uint32_t)cell[1]) << 1) | (SpreadBits((uint32_t)cell[2]) << 2);
+        codes[i].second = (int)i;
+    }
+    
+    std::sort(codes.begin(), codes.end());
+    
+    for (size_t i = 0; i < numPoints; i++)
+        order[i] = codes[i].second;
+    
+    return order;
+}
+
+Search::Search(Engine engine)
+: _engine(engine)
 , _tree(nullptr)
+, _ppMap(_points)
+, _distance(_ppMap)
 {
 }
 
+const char* Search::StorageName()
+{
+#ifdef DEFORM_SEARCH_MAP_POINTS
+    return "map";
+#else
+    return "vector";
+#endif
+}
+
+const char* Search::EngineName(Engine engine)
+{
+    switch (engine)
+    {
+        case EngineCGAL: return "cgal";
+        case EngineFlat: return "flat";
+    }
+    
+    return "unknown";
+}
+
+bool Search::ParseEngine(const std::string& name, Engine& engine)
+{
+    std::string lower = name;
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+    
+    for (auto e : {EngineCGAL, EngineFlat})
+    {
+        if (lower == EngineName(e))
+        {
+            engine = e;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+void Search::setEngine(Engine engine)
+{
+    clear();
+    
+    _engine = engine;
+}
+
 void Search::setMesh(MeshPtr mesh, bool setBounds)
 {
     clear();
@@ -48,9 +151,10 @@ void Search::setMesh(MeshPtr mesh, bool setBounds)
 void Search::clear()
 {
     _tree = nullptr;//.clear();
+    _flat.clear();
     _points.clear();
+    _keys.clear();
     _normals.clear();
-    _numAdded = 0;
 }
 
 void Search::addFaces(bool useNormal, bool useUV)
@@ -63,7 +167,9 @@ void Search::addFaces(bool useNormal, bool useUV)
         _normals.resize(_mesh->n_faces());
     }
     
-    //_points.resize(_mesh->n_faces());
+#ifndef DEFORM_SEARCH_MAP_POINTS
+    _points.resize(_mesh->n_faces());
+#endif
     
     Mesh::Point centroid;
     Mesh::Point normal;
@@ -94,16 +200,11 @@ void Search::addFaces(bool useNormal, bool useUV)
     }
     
     _target = Face;
-    
-    _tree = std::make_unique<Tree>(Splitter(), TreeTraits(_ppMap));
-    _tree->insert(boost::counting_iterator<std::size_t>(0), boost::counting_iterator<std::size_t>(_points.size()));
-    _tree->build();
-    
-    _distance = Distance(_ppMap);
-    
     _useNormal = useNormal;
     
-    std::cout << "Search - Faces: " << _points.size() << std::endl;
+    build();
+    
+    std::cout << "Search - Faces: " << _keys.size() << std::endl;
 }
 
 void Search::addVertices(bool useNormal, bool useUV)
@@ -116,7 +217,9 @@ void Search::addVertices(bool useNormal, bool useUV)
     if (useNormal)
         _normals.resize(_mesh->n_vertices());
     
-    //_points.resize(_mesh->n_vertices());
+#ifndef DEFORM_SEARCH_MAP_POINTS
+    _points.resize(_mesh->n_vertices());
+#endif
     
     for(auto vert_iter = _mesh->vertices_begin(), vert_end = _mesh->vertices_end(); vert_iter != vert_end; vert_iter++)
     {
@@ -144,31 +247,56 @@ void Search::addVertices(bool useNormal, bool useUV)
     }
     
     _target = Vertex;
+    _useNormal = useNormal;
     
-    _tree = std::make_unique<Tree>(Splitter(), TreeTraits(_ppMap));
-    _tree->insert(boost::counting_iterator<std::size_t>(0), boost::counting_iterator<std::size_t>(_points.size()));
-    _tree->build();
+    build();
     
-    _distance = Distance(_ppMap);
+    std::cout << "Search - Vertices: " << _keys.size() << std::endl;
+}
+
+void Search::build()
+{
+    if (_engine == EngineCGAL)
+    {
+        _tree = std::make_unique<Tree>(Splitter(), TreeTraits(_ppMap));
+        _tree->insert(_keys.begin(), _keys.end());
+        _tree->build();
+        
+        _distance = Distance(_ppMap);
+        
+        return;
+    }
     
-    _useNormal = useNormal;
+    const auto numItems = _target == Face ? _mesh->n_faces() : _mesh->n_vertices();
+    
+    std::vector<Vector3> points(numItems);
+    std::vector<Vector3> normals(_useNormal ? numItems : 0);
+    
+    for (auto key : _keys)
+    {
+        const auto& point = get(_ppMap, key);
+        points[key] = Vector3(point.x(), point.y(), point.z());
+        
+        if (_useNormal)
+            normals[key] = toEigen(_normals[key]);
+    }
     
-    std::cout << "Search - Vertices: " << _points.size() << std::endl;
+    _flat.build(points, normals, _keys);
 }
 
 void Search::add(const Mesh::VertexHandle& v, const Mesh::Point& p)
 {
     _points[v.idx()] = Point_d(p[0], p[1], p[2]);
-    _numAdded++;
+    _keys.push_back(v.idx());
 }
 
 void Search::add(const Mesh::FaceHandle& f, const Mesh::Point& p)
 {
     _points[f.idx()] = Point_d(p[0], p[1], p[2]);
-    _numAdded++;
+    _keys.push_back(f.idx());
 }
 
-bool Search::getNearest(const OpenMesh::Vec3d& p, const OpenMesh::Vec3d& n, Result& result)
+bool Search::getNearest(const OpenMesh::Vec3d& p, const OpenMesh::Vec3d& n, Result& result, Context* context)
 {
     result.idx = -1;
     result.distanceSqr = __DBL_MAX__;
@@ -177,6 +305,19 @@ bool Search::getNearest(const OpenMesh::Vec3d& p, const OpenMesh::Vec3d& n, Resu
         if (isZero(n))
             return false;
     
+    if (_engine == EngineFlat)
+    {
+        FlatKdTree::Hit hit;
+        
+        if (!_flat.nearest(toEigen(p), toEigen(n), hit, context != nullptr ? &context->visited : nullptr))
+            return false;
+        
+        result.idx = hit.idx;
+        result.distanceSqr = hit.distanceSqr;
+        
+        return true;
+    }
+    
     const Point_d query(p[0], p[1], p[2]);
     
     IncrementalSearch search(*_tree, query, 0.0, true, _distance);
@@ -200,7 +341,7 @@ bool Search::getNearest(const OpenMesh::Vec3d& p, const OpenMesh::Vec3d& n, Resu
     return result.idx != -1;
 }
 
-bool Search::getRange(const Mesh::Point& p, const Mesh::Point& n, float threshold, Results& results, Context* context)
+bool Search::getNearest(const OpenMesh::Vec3d& p, const OpenMesh::Vec3d& n, int k, Results& results, Context* context)
 {
     results.clear();
     
@@ -208,16 +349,91 @@ bool Search::getRange(const Mesh::Point& p, const Mesh::Point& n, float threshol
         if (isZero(n))
             return false;
     
-    // Squared-distance/threshold
-    //const auto thresholdSqr = threshold * threshold;
+    if (_engine == EngineFlat)
+    {
+        FlatKdTree::Hits hits;
+        _flat.nearest(toEigen(p), toEigen(n), k, hits, context != nullptr ? &context->visited : nullptr);
+        
+        for (const auto& hit : hits)
+            results.push_back(Result{hit.idx, hit.distanceSqr});
+        
+        return !results.empty();
+    }
+    
+    const Point_d query(p[0], p[1], p[2]);
+    
+    IncrementalSearch search(*_tree, query, 0.0, true, _distance);
+    
+    for(auto it = search.begin(); it != search.end() && (int)results.size() < k; ++it)
+    {
+        if (_useNormal)
+        {
+            const auto& normal = _normals[it->first];
+            
+            if ((normal | n) <= 0)
+                continue;
+        }
+        
+        results.push_back(Result{(int)it->first, it->second});
+    }
+    
+    return !results.empty();
+}
+
+bool Search::getRange(const Mesh::Point& p, const Mesh::Point& n, float threshold, Results& results, Context* context, int limit)
+{
+    results.clear();
+    
+    if (_useNormal)
+        if (isZero(n))
+            return false;
     
     if (context == nullptr)
         context = &_context;
     
     context->results.clear();
     
+    if (_engine == EngineFlat)
+    {
+        if (limit > 0)
+            _flat.nearest(toEigen(p), toEigen(n), limit, threshold, context->hits, &context->visited);
+        else
+            _flat.range(toEigen(p), toEigen(n), threshold, context->hits, &context->visited);
+        
+        for (const auto& hit : context->hits)
+            results.push_back(Result{hit.idx, hit.distanceSqr});
+        
+        return !results.empty();
+    }
+    
     const Point_d query(p[0], p[1], p[2]);
     
+    if (limit > 0)
+    {
+        // Hits arrive nearest first, so stop at the threshold or the limit.
+        const auto thresholdSqr = (double)threshold * threshold;
+        
+        IncrementalSearch search(*_tree, query, 0.0, true, _distance);
+        
+        for (auto it = search.begin(); it != search.end() && (int)results.size() < limit; ++it)
+        {
+            if (it->second > thresholdSqr)
+                break;
+            
+            if (_useNormal)
+            {
+                const auto& normal = _normals[it->first];
+                
+                if ((normal | n) <= 0)
+                    continue;
+            }
+            
+            results.push_back(Result{(int)it->first, it->second});
+        }
+        
+        return !results.empty();
+    }
+    
     FuzzySphere sphere(query, threshold, 0.0, TreeTraits(_ppMap));
     
     _tree->search(std::back_inserter(context->results), sphere);
@@ -232,38 +448,74 @@ bool Search::getRange(const Mesh::Point& p, const Mesh::Point& n, float threshol
                 continue;
         }
         
-        if (result >= _points.size())
-            continue;
-        
-        const auto& r = _points[result];
+        const auto& r = get(_ppMap, result);
         auto distanceSqr = 0.0;
         for (auto i = 0; i < 3; i++)
-            distanceSqr += (r[i] * query[i]);
+            distanceSqr += (r[i] - query[i]) * (r[i] - query[i]);
         
         results.push_back(Result{(int)result, distanceSqr});
     }
     
-    //Search search(*_tree, query, 0.0, true, _distance);
-    
-//    for(auto it = search.begin(); it != search.end(); ++it)
-//    {
-//        if (it->second >= thresholdSqr)
-//            break;
-//
-//        if (_useNormal)
-//        {
-//            const auto& normal = _normals[it->first];
-//
-//            if ((normal | n) <= 0)
-//                continue;
-//        }
-//
-//        results.push_back(Result{(int)it->first, it->second});
-//    }
-    
     return !results.empty();
 }
 
+void Search::getNearestBatch(const std::vector<Mesh::Point>& points, const std::vector<Mesh::Normal>& normals, Results& results, int threads, Context* context)
+{
+    results.assign(points.size(), Result{-1, __DBL_MAX__});
+    
+    const auto order = MortonOrder(points);
+    
+    std::atomic<size_t> visited(0);
+    
+    ParallelRanges(order.size(), threads,
+    [this, &points, &normals, &results, &order, &visited]
+    (size_t begin, size_t end, int /*threadId*/)
+    {
+        Context threadContext;
+        
+        for (auto i = begin; i < end; i++)
+        {
+            const auto query = order[i];
+            
+            getNearest(points[query], normals[query], results[query], &threadContext);
+        }
+        
+        visited += threadContext.visited;
+    });
+    
+    if (context != nullptr)
+        context->visited += visited;
+}
+
+void Search::getRangeBatch(const std::vector<Mesh::Point>& points, const std::vector<Mesh::Normal>& normals, float threshold, std::vector<Results>& results, int threads, Context* context, int limit)
+{
+    results.clear();
+    results.resize(points.size());
+    
+    const auto order = MortonOrder(points);
+    
+    std::atomic<size_t> visited(0);
+    
+    ParallelRanges(order.size(), threads,
+    [this, &points, &normals, threshold, limit, &results, &order, &visited]
+    (size_t begin, size_t end, int /*threadId*/)
+    {
+        Context threadContext;
+        
+        for (auto i = begin; i < end; i++)
+        {
+            const auto query = order[i];
+            
+            getRange(points[query], normals[query], threshold, results[query], &threadContext, limit);
+        }
+        
+        visited += threadContext.visited;
+    });
+    
+    if (context != nullptr)
+        context->visited += visited;
+}
+
 bool IsEqual(const Search::Result& a, const Search::Result& b)
 {
     return a.idx == b.idx;
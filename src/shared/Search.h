@@ -1,5 +1,6 @@
 #pragma once
 
+#include "FlatKdTree.h"
 #include "Mesh.h"
 
 #include <CGAL/Simple_cartesian.h>
@@ -8,7 +9,6 @@
 #include <CGAL/Orthogonal_incremental_neighbor_search.h>
 #include <CGAL/Search_traits_3.h>
 #include <CGAL/Search_traits_adapter.h>
-#include <CGAL/boost/iterator/counting_iterator.hpp>
 #include <CGAL/Fuzzy_sphere.h>
 
 #include <utility>
@@ -18,7 +18,7 @@
 #include <map>
 #include <vector>
 #include <memory>
-#include <list>
+#include <string>
 
 class Search
 {
@@ -26,52 +26,35 @@ private:
     typedef CGAL::Exact_predicates_inexact_constructions_kernel Kernel;
     typedef Kernel::Point_3 Point_d;
     
-    struct PointContainerVector : public std::vector<std::pair<size_t, Point_d>>
+    // Reads points from a vector by index, keys are dense 0..N-1.
+    struct PointVectorMap
     {
-        typedef size_t key_type;
-        typedef std::pair<key_type, Point_d> value_type;
-        
-        //static std::vector<value_type> _temp;
+        typedef std::size_t key_type;
+        typedef Point_d value_type;
+        typedef const Point_d& reference;
+        typedef boost::readable_property_map_tag category;
         
-        PointContainerVector()
-        : std::vector<std::pair<size_t, Point_d>>()
-        {
-            //_temp.resize(1);
-        }
-        
-        inline iterator find(key_type k)
-        {
-            return begin() + k;
-//            _temp[0].first = k;
-//            _temp[0].second = (*this)[k];
-//            return _temp.begin();
-        }
+        const std::vector<Point_d>* points;
         
-        inline const_iterator find(key_type k) const
+        PointVectorMap(const std::vector<Point_d>& points)
+        : points(&points)
         {
-            return cbegin() + k;
-//            _temp[0].first = k;
-//            _temp[0].second = (*this)[k];
-//            return _temp.cbegin();
         }
         
-        inline value_type::second_type& operator[](size_t k)
+        friend reference get(const PointVectorMap& map, key_type key)
         {
-            auto& p = *find(k);
-            
-            p.first = k;
-            
-            return p.second;
+            return (*map.points)[key];
         }
-        
-        //const value_type* find(key_type k) const { _temp.first = k; _temp.second = (*this)[k]; return &_temp; }
-        //const_iterator find(key_type k) const { return cbegin() + k; }
     };
     
+#ifdef DEFORM_SEARCH_MAP_POINTS
+    // Previous tree based storage, kept for benchmarking.
     typedef std::map<size_t, Point_d> PointContainer;
-    //typedef PointContainerVector PointContainer;
-    
     typedef boost::const_associative_property_map<PointContainer> point_property_map;
+#else
+    typedef std::vector<Point_d> PointContainer;
+    typedef PointVectorMap point_property_map;
+#endif
     
     typedef CGAL::Search_traits_3<Kernel> TreeTraits_Base;
     typedef CGAL::Search_traits_adapter<std::size_t, point_property_map, TreeTraits_Base> TreeTraits;
@@ -94,6 +77,14 @@ private:
     };
     
 public:
+    // Index behind the queries. CGAL, the default, is the incremental neighbor
+    // search. Flat keeps nodes in one array and points in contiguous runs.
+    enum Engine
+    {
+        EngineCGAL,
+        EngineFlat
+    };
+    
     struct Result
     {
         int idx;
@@ -103,12 +94,32 @@ public:
     struct Context
     {
         std::vector<size_t> results;
+        FlatKdTree::Hits hits;
+        
+        // Nodes entered by the flat engine, summed over queries.
+        size_t visited = 0;
     };
     
     typedef std::vector<Result> Results;
     
 public:
-	Search();
+	Search(Engine engine = EngineCGAL);
+    
+    // Name of the point storage compiled in, for benchmarks.
+    static const char* StorageName();
+    
+    static const char* EngineName(Engine engine);
+    
+    // Accepts the names returned by EngineName, case insensitive.
+    static bool ParseEngine(const std::string& name, Engine& engine);
+    
+    Engine engine() const { return _engine; }
+    
+    // Clears the search, items must be added again.
+    void setEngine(Engine engine);
+    
+    // Skip subtrees whose normals all face away from the query, flat engine only.
+    void setNormalCones(bool normalCones) { _flat.setNormalCones(normalCones); }
     
     void setMesh(MeshPtr mesh, bool setBounds = true);
     
@@ -117,29 +128,48 @@ public:
     void addFaces(bool useNormal = true, bool useUV = false);
     void addVertices(bool useNormal = true, bool useUV = false);
     
-    bool getNearest(const OpenMesh::Vec3d& p, const OpenMesh::Vec3d& n, Result& result);
+    bool getNearest(const OpenMesh::Vec3d& p, const OpenMesh::Vec3d& n, Result& result, Context* context = nullptr);
+    
+    // Up to k nearest, sorted by distance.
+    bool getNearest(const OpenMesh::Vec3d& p, const OpenMesh::Vec3d& n, int k, Results& results, Context* context = nullptr);
+    
+    // Everything within threshold of p. With limit > 0, only the limit nearest
+    // of those, sorted by distance, kept in a bounded heap while searching.
+    bool getRange(const Mesh::Point& p, const Mesh::Point& n, float threshold, Results& results, Context* context = nullptr, int limit = -1);
     
-    bool getRange(const Mesh::Point& p, const Mesh::Point& n, float threshold, Results& results, Context* context = nullptr);
+    // One query per point, run in parallel in Morton order of the points so
+    // neighboring queries walk the same nodes. Results are in input order,
+    // an idx of -1 or an empty range means nothing was found. threads <= 0
+    // uses all cores, visited node counts are added to context.
+    void getNearestBatch(const std::vector<Mesh::Point>& points, const std::vector<Mesh::Normal>& normals, Results& results, int threads = 0, Context* context = nullptr);
+    
+    void getRangeBatch(const std::vector<Mesh::Point>& points, const std::vector<Mesh::Normal>& normals, float threshold, std::vector<Results>& results, int threads = 0, Context* context = nullptr, int limit = -1);
     
 private:
+    Engine _engine;
+    
     MeshPtr _mesh;
     
     TreePtr _tree;
+    FlatKdTree _flat;
     
     PointContainer _points;
     Context _context;
     
+    // Keys of the added points, items with invalid normals are skipped.
+    std::vector<size_t> _keys;
+    
     std::vector<OpenMesh::Vec3d> _normals;
     
     Target _target;
     
-    Distance _distance;
-    
     point_property_map _ppMap;
     
+    Distance _distance;
+    
     bool _useNormal;
     
-    int _numAdded;
+    void build();
     
     void add(const Mesh::VertexHandle& v, const Mesh::Point& p);
     void add(const Mesh::FaceHandle& f, const Mesh::Point& p);
@@ -0,0 +1,160 @@
+//
+//  Serialize.h
+//  Deform
+//
+//  Binary read/write helpers for cached solver state.
+//
+
+#ifndef Serialize_h
+#define Serialize_h
+
+#include "Matrix.h"
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+template<typename T>
+inline bool WriteValue(std::ostream& out, const T& v)
+{
+    out.write(reinterpret_cast<const char*>(&v), sizeof(T));
+    return out.good();
+}
+
+template<typename T>
+inline bool ReadValue(std::istream& in, T& v)
+{
+    in.read(reinterpret_cast<char*>(&v), sizeof(T));
+    return in.good();
+}
+
+template<typename T>
+inline bool WriteArray(std::ostream& out, const T* v, size_t size)
+{
+    if (!WriteValue(out, (uint64_t)size))
+        return false;
+    
+    out.write(reinterpret_cast<const char*>(v), sizeof(T) * size);
+    return out.good();
+}
+
+// Bytes between the read position and the end of the stream, or the
+// maximum for streams that cannot seek.
+inline uint64_t RemainingBytes(std::istream& in)
+{
+    const auto position = in.tellg();
+    if (position < 0)
+        return UINT64_MAX;
+    
+    in.seekg(0, std::ios::end);
+    const auto end = in.tellg();
+    in.seekg(position);
+    
+    return end > position ? (uint64_t)(end - position) : 0;
+}
+
+// Fails without resizing when the stored size is above maxSize or longer
+// than the rest of the stream, so a damaged file cannot force a huge allocation.
+template<typename T>
+inline bool ReadArray(std::istream& in, std::vector<T>& v, size_t maxSize)
+{
+    uint64_t size;
+    if (!ReadValue(in, size))
+        return false;
+    
+    if (size > maxSize || size > RemainingBytes(in) / sizeof(T))
+        return false;
+    
+    v.resize(size);
+    in.read(reinterpret_cast<char*>(v.data()), sizeof(T) * size);
+    return in.good();
+}
+
+template<typename T>
+inline bool WriteVector(std::ostream& out, const std::vector<T>& v)
+{
+    return WriteArray(out, v.data(), v.size());
+}
+
+inline bool WriteSparse(std::ostream& out, const SparseMatrix& m)
+{
+    if (!m.isCompressed())
+        return false;
+    
+    return WriteValue(out, (int64_t)m.rows())
+        && WriteValue(out, (int64_t)m.cols())
+        && WriteArray(out, m.outerIndexPtr(), m.outerSize() + 1)
+        && WriteArray(out, m.innerIndexPtr(), m.nonZeros())
+        && WriteArray(out, m.valuePtr(), m.nonZeros());
+}
+
+// Reads a matrix written by WriteSparse, which must be rows x cols. The
+// structure is validated before it is used, any mismatch fails the read.
+inline bool ReadSparse(std::istream& in, SparseMatrix& m, int64_t rows, int64_t cols)
+{
+    int64_t fileRows, fileCols;
+    std::vector<SparseMatrix::StorageIndex> outer, inner;
+    std::vector<double> values;
+    
+    if (!ReadValue(in, fileRows) || !ReadValue(in, fileCols) || fileRows != rows || fileCols != cols)
+        return false;
+    
+    if (!ReadArray(in, outer, (size_t)cols + 1) || outer.size() != (size_t)cols + 1 || outer[0] != 0)
+        return false;
+    
+    // Column starts never decrease, the last one is the number of non zeros.
+    for (int64_t i = 0; i < cols; i++)
+    {
+        if (outer[i + 1] < outer[i])
+            return false;
+    }
+    
+    const auto nonZeros = (size_t)outer[cols];
+    
+    if (!ReadArray(in, inner, nonZeros) || !ReadArray(in, values, nonZeros)
+        || inner.size() != nonZeros || values.size() != nonZeros)
+        return false;
+    
+    for (auto index : inner)
+    {
+        if (index < 0 || index >= rows)
+            return false;
+    }
+    
+    m = Eigen::Map<const SparseMatrix>(rows, cols, (Eigen::Index)values.size(), outer.data(), inner.data(), values.data());
+    m.makeCompressed();
+    
+    return true;
+}
+
+// FNV-1a, used to key cache files to the data they were built from.
+class Hasher
+{
+public:
+    Hasher() : _hash(14695981039346656037ULL) {}
+    
+    void add(const void* data, size_t size)
+    {
+        const auto bytes = reinterpret_cast<const unsigned char*>(data);
+        
+        for (size_t i = 0; i < size; i++)
+        {
+            _hash ^= bytes[i];
+            _hash *= 1099511628211ULL;
+        }
+    }
+    
+    template<typename T>
+    void add(const T& v)
+    {
+        add(&v, sizeof(T));
+    }
+    
+    uint64_t value() const { return _hash; }
+    
+private:
+    uint64_t _hash;
+};
+
+#endif /* Serialize_h */
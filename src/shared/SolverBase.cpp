@@ -9,12 +9,16 @@
 #include "SolverBase.h"
 
 #include "Util.h"
+#include "Parallel.h"
+#include "SurfaceKernels.h"
 
 #include <iostream>
 
 Matrix9x1 SolverBase::C_Identity;
 
 SolverBase::SolverBase()
+: _solver(LinearSolver::Create(LinearSolverType::LDLT))
+, _threads(0)
 {
     Eigen::initParallel();
     
@@ -24,14 +28,46 @@ SolverBase::SolverBase()
         0, 0, 1;
 }
 
+void SolverBase::setThreads(int threads)
+{
+    _threads = threads;
+    
+    // Eigen's own parallel products, only used when built with OpenMP.
+    Eigen::setNbThreads(ThreadCount(threads));
+}
+
+int SolverBase::threads() const
+{
+    return ThreadCount(_threads);
+}
+
+bool SolverBase::setSolver(LinearSolverType type)
+{
+    auto solver = LinearSolver::Create(type);
+    if (!solver)
+    {
+        std::cerr << "Solver not available: " << LinearSolverName(type) << std::endl;
+        return false;
+    }
+    
+    _solver = std::move(solver);
+    
+    return true;
+}
+
+LinearSolver& SolverBase::solver()
+{
+    return *_solver;
+}
+
 bool SolverBase::checkSolverError() const
 {
-    if (_solver.info() == Eigen::Success)
+    if (_solver->info() == Eigen::Success)
         return true;
     
     std::cerr
     << "*******" << std::endl
-    << "**Eigen Solver Error: " << Error(_solver.info()) << std::endl
+    << "**Eigen Solver Error: " << Error(_solver->info()) << std::endl
     << "*******" << std::endl;
     
     return false;
@@ -124,6 +160,43 @@ void SolverBase::calculateInvSurface(const Mesh& ref, const Mesh::FaceHandle& re
     inv = Vr.inverse();
 }
 
+void SolverBase::calculateSurface(const FaceGeometry& ref, size_t face, Matrix3x3& s) const
+{
+    constructTriangleNormMatrix(ref, face, s);
+}
+
+void SolverBase::calculateInvSurface(const FaceGeometry& ref, size_t face, Matrix3x3& inv) const
+{
+    Matrix3x3 Vr;
+    calculateSurface(ref, face, Vr);
+    
+    inv = Vr.inverse();
+}
+
+void SolverBase::calculateSurfaces(const FaceGeometry& ref, std::vector<Matrix3x3>& s) const
+{
+    s.resize(ref.numFaces());
+    
+    ParallelRanges(ref.numFaces(), _threads,
+    [&ref, &s]
+    (size_t begin, size_t end, int /*threadId*/)
+    {
+        CalculateSurfaces(ref, begin, end, s.data() + begin, nullptr, nullptr);
+    });
+}
+
+void SolverBase::calculateInvSurfaces(const FaceGeometry& ref, std::vector<Matrix3x3>& inv) const
+{
+    inv.resize(ref.numFaces());
+    
+    ParallelRanges(ref.numFaces(), _threads,
+    [&ref, &inv]
+    (size_t begin, size_t end, int /*threadId*/)
+    {
+        CalculateSurfaces(ref, begin, end, nullptr, inv.data() + begin, nullptr);
+    });
+}
+
 void SolverBase::constructTriangleNormMatrix(const Mesh& mesh, const Mesh::FaceHandle& face, Matrix3x3& v) const
 {
     Mesh::VertexHandle vertices[3];
@@ -140,6 +213,26 @@ void SolverBase::constructTriangleNormMatrix(const Mesh& mesh, const Mesh::FaceH
     v.col(2) = n;
 }
 
+void SolverBase::constructTriangleNormMatrix(const FaceGeometry& geometry, size_t face, Matrix3x3& v) const
+{
+    const auto x = geometry.x();
+    const auto y = geometry.y();
+    const auto z = geometry.z();
+    
+    const auto i0 = geometry.vertex(face, 0);
+    const auto i1 = geometry.vertex(face, 1);
+    const auto i2 = geometry.vertex(face, 2);
+    
+    const Vector3 v0(x[i0], y[i0], z[i0]);
+    const Vector3 e0 = Vector3(x[i1], y[i1], z[i1]) - v0;
+    const Vector3 e1 = Vector3(x[i2], y[i2], z[i2]) - v0;
+    const auto n = calculatePhantom(v0, e0, e1);
+    
+    v.col(0) = e0;
+    v.col(1) = e1;
+    v.col(2) = n;
+}
+
 Eigen::Vector3d SolverBase::calculatePhantom(const Eigen::Vector3d& v0, const Eigen::Vector3d& e0, const Eigen::Vector3d& e1) const
 {
     const auto n = e0.cross(e1);
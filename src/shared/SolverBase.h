@@ -10,17 +10,33 @@
 #define SolverBase_h
 
 #include "Mesh.h"
+#include "FaceGeometry.h"
 
 #include "Matrix.h"
+#include "LinearSolver.h"
+
+#include <memory>
 
 class SolverBase
 {
+public:
+    // Threads used for per-face work, <= 0 uses all cores.
+    void setThreads(int threads);
+    int threads() const;
+    
+    // Sparse solver for the normal equations, LDLT by default.
+    // Fails and keeps the current solver if the type was not compiled in.
+    bool setSolver(LinearSolverType type);
+    LinearSolver& solver();
+    
 protected:
     static Matrix9x1 C_Identity;
     
     SolverBase();
     
-    Eigen::SimplicialLDLT<SparseMatrix> _solver;
+    std::unique_ptr<LinearSolver> _solver;
+    
+    int _threads;
     
     bool checkSolverError() const;
     
@@ -34,7 +50,15 @@ protected:
     void calculateSurface(const Mesh& ref, const Mesh::FaceHandle& refFace, Matrix3x3& s) const;
     void calculateInvSurface(const Mesh& ref, const Mesh::FaceHandle& refFace, Matrix3x3& inv) const;
     
+    void calculateSurface(const FaceGeometry& ref, size_t face, Matrix3x3& s) const;
+    void calculateInvSurface(const FaceGeometry& ref, size_t face, Matrix3x3& inv) const;
+    
+    // Every face at once, through the batched SIMD kernels.
+    void calculateSurfaces(const FaceGeometry& ref, std::vector<Matrix3x3>& s) const;
+    void calculateInvSurfaces(const FaceGeometry& ref, std::vector<Matrix3x3>& inv) const;
+    
     void constructTriangleNormMatrix(const Mesh& mesh, const Mesh::FaceHandle& face, Matrix3x3& v) const;
+    void constructTriangleNormMatrix(const FaceGeometry& geometry, size_t face, Matrix3x3& v) const;
     
     Eigen::Vector3d calculatePhantom(const Eigen::Vector3d& v0, const Eigen::Vector3d& e0, const Eigen::Vector3d& e1) const;
 };
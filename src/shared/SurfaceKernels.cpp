@@ -0,0 +1,290 @@
+//
+//  SurfaceKernels.cpp
+//  Deform
+//
+
+#include "SurfaceKernels.h"
+
+#include <cmath>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SURFACE_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+// Writes faces [i, i + width), lanes holds the 9 entries of [e0 e1 n] column-major
+// then the 9 of its inverse, each as a row of width lane values.
+template<int width>
+static inline void storeFaces(size_t i, const double (*lanes)[width], Matrix3x3* surfaces, Matrix3x3* invSurfaces, Vector3* phantoms)
+{
+    for (int lane = 0; lane < width; lane++)
+    {
+        if (surfaces != nullptr)
+        {
+            auto s = surfaces[i + lane].data();
+            for (int k = 0; k < 9; k++)
+                s[k] = lanes[k][lane];
+        }
+        
+        if (invSurfaces != nullptr)
+        {
+            auto inv = invSurfaces[i + lane].data();
+            for (int k = 0; k < 9; k++)
+                inv[k] = lanes[9 + k][lane];
+        }
+        
+        if (phantoms != nullptr)
+        {
+            auto n = phantoms[i + lane].data();
+            for (int k = 0; k < 3; k++)
+                n[k] = lanes[6 + k][lane];
+        }
+    }
+}
+
+static void calculateScalar(const FaceGeometry& geometry, size_t begin, size_t end, Matrix3x3* surfaces, Matrix3x3* invSurfaces, Vector3* phantoms)
+{
+    const auto x = geometry.x();
+    const auto y = geometry.y();
+    const auto z = geometry.z();
+    
+    double m[18][1];
+    
+    for (auto face = begin; face < end; face++)
+    {
+        const auto i0 = geometry.vertex(face, 0);
+        const auto i1 = geometry.vertex(face, 1);
+        const auto i2 = geometry.vertex(face, 2);
+        
+        const Vector3 v0(x[i0], y[i0], z[i0]);
+        const Vector3 e0 = Vector3(x[i1], y[i1], z[i1]) - v0;
+        const Vector3 e1 = Vector3(x[i2], y[i2], z[i2]) - v0;
+        
+        const Vector3 c = e0.cross(e1);
+        const Vector3 n = c / std::sqrt(c.norm());
+        
+        // Rows of the inverse of [e0 e1 n] are the cross products of its columns over the determinant.
+        const auto invDet = 1.0 / e0.dot(e1.cross(n));
+        const Vector3 r0 = e1.cross(n) * invDet;
+        const Vector3 r1 = n.cross(e0) * invDet;
+        const Vector3 r2 = c * invDet;
+        
+        Eigen::Map<Matrix3x3> s(m[0]);
+        s.col(0) = e0;
+        s.col(1) = e1;
+        s.col(2) = n;
+        
+        Eigen::Map<Matrix3x3> inv(m[9]);
+        inv.row(0) = r0;
+        inv.row(1) = r1;
+        inv.row(2) = r2;
+        
+        storeFaces<1>(face - begin, m, surfaces, invSurfaces, phantoms);
+    }
+}
+
+#ifdef SURFACE_KERNELS_X86
+
+__attribute__((target("avx2,fma")))
+static size_t calculateAVX2(const FaceGeometry& geometry, size_t begin, size_t end, Matrix3x3* surfaces, Matrix3x3* invSurfaces, Vector3* phantoms)
+{
+    const auto x = geometry.x();
+    const auto y = geometry.y();
+    const auto z = geometry.z();
+    
+    const int* v[3] = { geometry.vertices(0), geometry.vertices(1), geometry.vertices(2) };
+    
+    const auto one = _mm256_set1_pd(1.0);
+    
+    alignas(32) double lanes[18][4];
+    
+    auto face = begin;
+    
+    for (; face + 4 <= end; face += 4)
+    {
+        __m256d px[3], py[3], pz[3];
+        
+        for (int corner = 0; corner < 3; corner++)
+        {
+            const auto idx = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v[corner] + face));
+            
+            px[corner] = _mm256_i32gather_pd(x, idx, 8);
+            py[corner] = _mm256_i32gather_pd(y, idx, 8);
+            pz[corner] = _mm256_i32gather_pd(z, idx, 8);
+        }
+        
+        const auto e0x = _mm256_sub_pd(px[1], px[0]);
+        const auto e0y = _mm256_sub_pd(py[1], py[0]);
+        const auto e0z = _mm256_sub_pd(pz[1], pz[0]);
+        
+        const auto e1x = _mm256_sub_pd(px[2], px[0]);
+        const auto e1y = _mm256_sub_pd(py[2], py[0]);
+        const auto e1z = _mm256_sub_pd(pz[2], pz[0]);
+        
+        // c = e0 x e1
+        const auto cx = _mm256_fmsub_pd(e0y, e1z, _mm256_mul_pd(e0z, e1y));
+        const auto cy = _mm256_fmsub_pd(e0z, e1x, _mm256_mul_pd(e0x, e1z));
+        const auto cz = _mm256_fmsub_pd(e0x, e1y, _mm256_mul_pd(e0y, e1x));
+        
+        // n = c / sqrt(|c|)
+        const auto lenSqr = _mm256_fmadd_pd(cx, cx, _mm256_fmadd_pd(cy, cy, _mm256_mul_pd(cz, cz)));
+        const auto invL = _mm256_div_pd(one, _mm256_sqrt_pd(_mm256_sqrt_pd(lenSqr)));
+        
+        const auto nx = _mm256_mul_pd(cx, invL);
+        const auto ny = _mm256_mul_pd(cy, invL);
+        const auto nz = _mm256_mul_pd(cz, invL);
+        
+        // r0 = e1 x n, r1 = n x e0, r2 = e0 x e1 = c
+        const auto r0x = _mm256_fmsub_pd(e1y, nz, _mm256_mul_pd(e1z, ny));
+        const auto r0y = _mm256_fmsub_pd(e1z, nx, _mm256_mul_pd(e1x, nz));
+        const auto r0z = _mm256_fmsub_pd(e1x, ny, _mm256_mul_pd(e1y, nx));
+        
+        const auto r1x = _mm256_fmsub_pd(ny, e0z, _mm256_mul_pd(nz, e0y));
+        const auto r1y = _mm256_fmsub_pd(nz, e0x, _mm256_mul_pd(nx, e0z));
+        const auto r1z = _mm256_fmsub_pd(nx, e0y, _mm256_mul_pd(ny, e0x));
+        
+        const auto det = _mm256_fmadd_pd(e0x, r0x, _mm256_fmadd_pd(e0y, r0y, _mm256_mul_pd(e0z, r0z)));
+        const auto invDet = _mm256_div_pd(one, det);
+        
+        // Column-major surface, then column-major inverse with rows r0, r1, r2.
+        const __m256d out[18] = {
+            e0x, e0y, e0z,
+            e1x, e1y, e1z,
+            nx, ny, nz,
+            _mm256_mul_pd(r0x, invDet), _mm256_mul_pd(r1x, invDet), _mm256_mul_pd(cx, invDet),
+            _mm256_mul_pd(r0y, invDet), _mm256_mul_pd(r1y, invDet), _mm256_mul_pd(cy, invDet),
+            _mm256_mul_pd(r0z, invDet), _mm256_mul_pd(r1z, invDet), _mm256_mul_pd(cz, invDet)
+        };
+        
+        for (int k = 0; k < 18; k++)
+            _mm256_store_pd(lanes[k], out[k]);
+        
+        storeFaces<4>(face - begin, lanes, surfaces, invSurfaces, phantoms);
+    }
+    
+    return face;
+}
+
+__attribute__((target("avx512f")))
+static size_t calculateAVX512(const FaceGeometry& geometry, size_t begin, size_t end, Matrix3x3* surfaces, Matrix3x3* invSurfaces, Vector3* phantoms)
+{
+    const auto x = geometry.x();
+    const auto y = geometry.y();
+    const auto z = geometry.z();
+    
+    const int* v[3] = { geometry.vertices(0), geometry.vertices(1), geometry.vertices(2) };
+    
+    const auto one = _mm512_set1_pd(1.0);
+    
+    alignas(64) double lanes[18][8];
+    
+    auto face = begin;
+    
+    for (; face + 8 <= end; face += 8)
+    {
+        __m512d px[3], py[3], pz[3];
+        
+        for (int corner = 0; corner < 3; corner++)
+        {
+            const auto idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v[corner] + face));
+            
+            px[corner] = _mm512_i32gather_pd(idx, x, 8);
+            py[corner] = _mm512_i32gather_pd(idx, y, 8);
+            pz[corner] = _mm512_i32gather_pd(idx, z, 8);
+        }
+        
+        const auto e0x = _mm512_sub_pd(px[1], px[0]);
+        const auto e0y = _mm512_sub_pd(py[1], py[0]);
+        const auto e0z = _mm512_sub_pd(pz[1], pz[0]);
+        
+        const auto e1x = _mm512_sub_pd(px[2], px[0]);
+        const auto e1y = _mm512_sub_pd(py[2], py[0]);
+        const auto e1z = _mm512_sub_pd(pz[2], pz[0]);
+        
+        const auto cx = _mm512_fmsub_pd(e0y, e1z, _mm512_mul_pd(e0z, e1y));
+        const auto cy = _mm512_fmsub_pd(e0z, e1x, _mm512_mul_pd(e0x, e1z));
+        const auto cz = _mm512_fmsub_pd(e0x, e1y, _mm512_mul_pd(e0y, e1x));
+        
+        const auto lenSqr = _mm512_fmadd_pd(cx, cx, _mm512_fmadd_pd(cy, cy, _mm512_mul_pd(cz, cz)));
+        const auto invL = _mm512_div_pd(one, _mm512_sqrt_pd(_mm512_sqrt_pd(lenSqr)));
+        
+        const auto nx = _mm512_mul_pd(cx, invL);
+        const auto ny = _mm512_mul_pd(cy, invL);
+        const auto nz = _mm512_mul_pd(cz, invL);
+        
+        const auto r0x = _mm512_fmsub_pd(e1y, nz, _mm512_mul_pd(e1z, ny));
+        const auto r0y = _mm512_fmsub_pd(e1z, nx, _mm512_mul_pd(e1x, nz));
+        const auto r0z = _mm512_fmsub_pd(e1x, ny, _mm512_mul_pd(e1y, nx));
+        
+        const auto r1x = _mm512_fmsub_pd(ny, e0z, _mm512_mul_pd(nz, e0y));
+        const auto r1y = _mm512_fmsub_pd(nz, e0x, _mm512_mul_pd(nx, e0z));
+        const auto r1z = _mm512_fmsub_pd(nx, e0y, _mm512_mul_pd(ny, e0x));
+        
+        const auto det = _mm512_fmadd_pd(e0x, r0x, _mm512_fmadd_pd(e0y, r0y, _mm512_mul_pd(e0z, r0z)));
+        const auto invDet = _mm512_div_pd(one, det);
+        
+        const __m512d out[18] = {
+            e0x, e0y, e0z,
+            e1x, e1y, e1z,
+            nx, ny, nz,
+            _mm512_mul_pd(r0x, invDet), _mm512_mul_pd(r1x, invDet), _mm512_mul_pd(cx, invDet),
+            _mm512_mul_pd(r0y, invDet), _mm512_mul_pd(r1y, invDet), _mm512_mul_pd(cy, invDet),
+            _mm512_mul_pd(r0z, invDet), _mm512_mul_pd(r1z, invDet), _mm512_mul_pd(cz, invDet)
+        };
+        
+        for (int k = 0; k < 18; k++)
+            _mm512_store_pd(lanes[k], out[k]);
+        
+        storeFaces<8>(face - begin, lanes, surfaces, invSurfaces, phantoms);
+    }
+    
+    return face;
+}
+
+#endif
+
+SurfaceKernel DetectSurfaceKernel()
+{
+#ifdef SURFACE_KERNELS_X86
+    static const auto kernel =
+        __builtin_cpu_supports("avx512f") ? SurfaceKernel::AVX512 :
+        (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) ? SurfaceKernel::AVX2 :
+        SurfaceKernel::Scalar;
+    
+    return kernel;
+#else
+    return SurfaceKernel::Scalar;
+#endif
+}
+
+const char* SurfaceKernelName(SurfaceKernel kernel)
+{
+    switch (kernel)
+    {
+        case SurfaceKernel::Scalar: return "Scalar";
+        case SurfaceKernel::AVX2: return "AVX2";
+        case SurfaceKernel::AVX512: return "AVX-512";
+    }
+    
+    return "Unknown";
+}
+
+void CalculateSurfaces(const FaceGeometry& geometry, size_t begin, size_t end, Matrix3x3* surfaces, Matrix3x3* invSurfaces, Vector3* phantoms, SurfaceKernel kernel)
+{
+    auto face = begin;
+    
+#ifdef SURFACE_KERNELS_X86
+    if (kernel == SurfaceKernel::AVX512)
+        face = calculateAVX512(geometry, begin, end, surfaces, invSurfaces, phantoms);
+    else if (kernel == SurfaceKernel::AVX2)
+        face = calculateAVX2(geometry, begin, end, surfaces, invSurfaces, phantoms);
+#endif
+    
+    // Remainder, or everything on the scalar path.
+    const auto offset = face - begin;
+    
+    calculateScalar(geometry, face, end,
+                    surfaces != nullptr ? surfaces + offset : nullptr,
+                    invSurfaces != nullptr ? invSurfaces + offset : nullptr,
+                    phantoms != nullptr ? phantoms + offset : nullptr);
+}
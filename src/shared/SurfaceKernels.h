@@ -0,0 +1,32 @@
+//
+//  SurfaceKernels.h
+//  Deform
+//
+//  Batched surface matrix kernels over a FaceGeometry.
+//  For each face the surface matrix is [e0 e1 n], with n the phantom
+//  normal (e0 x e1) / sqrt(|e0 x e1|), as in SolverBase::constructTriangleNormMatrix.
+//  AVX2 and AVX-512 paths are selected at runtime, with a scalar fallback.
+//
+
+#ifndef SurfaceKernels_h
+#define SurfaceKernels_h
+
+#include "FaceGeometry.h"
+#include "Matrix.h"
+
+enum class SurfaceKernel
+{
+    Scalar,
+    AVX2,
+    AVX512
+};
+
+// Widest kernel supported by this build and CPU.
+SurfaceKernel DetectSurfaceKernel();
+
+const char* SurfaceKernelName(SurfaceKernel kernel);
+
+// Computes faces [begin, end), writing entry (face - begin) of each non-null output.
+void CalculateSurfaces(const FaceGeometry& geometry, size_t begin, size_t end, Matrix3x3* surfaces, Matrix3x3* invSurfaces, Vector3* phantoms, SurfaceKernel kernel = DetectSurfaceKernel());
+
+#endif /* SurfaceKernels_h */
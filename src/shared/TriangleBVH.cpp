@@ -0,0 +1,254 @@
+//
+//  TriangleBVH.cpp
+//  Deform
+//
+
+#include "TriangleBVH.h"
+
+#include <algorithm>
+#include <limits>
+
+// Triangles per leaf.
+static const int LeafSize = 4;
+
+// Squared distance from p to the box [min, max], zero inside.
+inline double BoxDistanceSqr(const Vector3& p, const Vector3& min, const Vector3& max)
+{
+    return (min - p).cwiseMax(p - max).cwiseMax(0.0).squaredNorm();
+}
+
+void TriangleBVH::build(const FaceGeometry& geometry)
+{
+    const auto numFaces = (int)geometry.numFaces();
+    
+    const auto x = geometry.x();
+    const auto y = geometry.y();
+    const auto z = geometry.z();
+    
+    _triangles.resize(numFaces);
+    
+    std::vector<Vector3> centroids(numFaces);
+    
+    for (int face = 0; face < numFaces; face++)
+    {
+        auto& triangle = _triangles[face];
+        
+        const auto i0 = geometry.vertex(face, 0);
+        const auto i1 = geometry.vertex(face, 1);
+        const auto i2 = geometry.vertex(face, 2);
+        
+        triangle.a = Vector3(x[i0], y[i0], z[i0]);
+        triangle.b = Vector3(x[i1], y[i1], z[i1]);
+        triangle.c = Vector3(x[i2], y[i2], z[i2]);
+        
+        // Degenerate triangles keep a zero normal and fail every normal test.
+        triangle.normal = (triangle.b - triangle.a).cross(triangle.c - triangle.a);
+        
+        const auto length = triangle.normal.norm();
+        if (length > 0.0)
+            triangle.normal /= length;
+        
+        triangle.face = face;
+        
+        centroids[face] = (triangle.a + triangle.b + triangle.c) / 3.0;
+    }
+    
+    _nodes.clear();
+    _nodes.reserve(std::max(1, 2 * numFaces / LeafSize));
+    
+    if (numFaces > 0)
+        buildNode(centroids, 0, numFaces);
+}
+
+int TriangleBVH::buildNode(std::vector<Vector3>& centroids, int start, int count)
+{
+    const auto index = (int)_nodes.size();
+    
+    _nodes.push_back(Node());
+    
+    Vector3 min = Vector3::Constant(std::numeric_limits<double>::max());
+    Vector3 max = Vector3::Constant(-std::numeric_limits<double>::max());
+    
+    Vector3 centroidMin = min;
+    Vector3 centroidMax = max;
+    
+    for (int i = start; i < start + count; i++)
+    {
+        const auto& triangle = _triangles[i];
+        
+        min = min.cwiseMin(triangle.a).cwiseMin(triangle.b).cwiseMin(triangle.c);
+        max = max.cwiseMax(triangle.a).cwiseMax(triangle.b).cwiseMax(triangle.c);
+        
+        centroidMin = centroidMin.cwiseMin(centroids[i]);
+        centroidMax = centroidMax.cwiseMax(centroids[i]);
+    }
+    
+    _nodes[index].min = min;
+    _nodes[index].max = max;
+    
+    if (count <= LeafSize)
+    {
+        _nodes[index].start = start;
+        _nodes[index].count = count;
+        
+        return index;
+    }
+    
+    // Median split along the longest axis of the centroids.
+    int axis;
+    (centroidMax - centroidMin).maxCoeff(&axis);
+    
+    const auto half = count / 2;
+    
+    std::vector<int> order(count);
+    for (int i = 0; i < count; i++)
+        order[i] = start + i;
+    
+    std::nth_element(order.begin(), order.begin() + half, order.end(),
+    [&centroids, axis]
+    (int a, int b)
+    {
+        return centroids[a][axis] < centroids[b][axis];
+    });
+    
+    std::vector<Triangle> triangles(count);
+    std::vector<Vector3> nodeCentroids(count);
+    
+    for (int i = 0; i < count; i++)
+    {
+        triangles[i] = _triangles[order[i]];
+        nodeCentroids[i] = centroids[order[i]];
+    }
+    
+    std::copy(triangles.begin(), triangles.end(), _triangles.begin() + start);
+    std::copy(nodeCentroids.begin(), nodeCentroids.end(), centroids.begin() + start);
+    
+    buildNode(centroids, start, half);
+    
+    const auto right = buildNode(centroids, start + half, count - half);
+    
+    _nodes[index].start = right;
+    _nodes[index].count = 0;
+    
+    return index;
+}
+
+bool TriangleBVH::closest(const Vector3& p, const Vector3& n, Hit& hit) const
+{
+    hit.face = -1;
+    hit.distanceSqr = std::numeric_limits<double>::max();
+    
+    if (_nodes.empty())
+        return false;
+    
+    const auto useNormal = !n.isZero();
+    
+    // Depth is logarithmic in the face count, 64 levels covers any mesh.
+    int stack[64];
+    int size = 0;
+    
+    stack[size++] = 0;
+    
+    while (size > 0)
+    {
+        const auto index = stack[--size];
+        const auto& node = _nodes[index];
+        
+        // Boxes at exactly the best distance may still hold a tie with a lower face index.
+        if (BoxDistanceSqr(p, node.min, node.max) > hit.distanceSqr)
+            continue;
+        
+        if (node.count > 0)
+        {
+            for (int i = node.start; i < node.start + node.count; i++)
+            {
+                const auto& triangle = _triangles[i];
+                
+                if (useNormal && triangle.normal.dot(n) <= 0.0)
+                    continue;
+                
+                const auto point = ClosestPointOnTriangle(p, triangle.a, triangle.b, triangle.c);
+                const auto distanceSqr = (point - p).squaredNorm();
+                
+                // Ties keep the lower face index, so results do not depend on the node order.
+                if (distanceSqr < hit.distanceSqr || (distanceSqr == hit.distanceSqr && triangle.face < hit.face))
+                {
+                    hit.face = triangle.face;
+                    hit.point = point;
+                    hit.distanceSqr = distanceSqr;
+                }
+            }
+            
+            continue;
+        }
+        
+        // Visit the nearer child first, it is pushed last.
+        const auto left = index + 1;
+        const auto right = node.start;
+        
+        const auto leftDistance = BoxDistanceSqr(p, _nodes[left].min, _nodes[left].max);
+        const auto rightDistance = BoxDistanceSqr(p, _nodes[right].min, _nodes[right].max);
+        
+        if (leftDistance <= rightDistance)
+        {
+            stack[size++] = right;
+            stack[size++] = left;
+        }
+        else
+        {
+            stack[size++] = left;
+            stack[size++] = right;
+        }
+    }
+    
+    return hit.face != -1;
+}
+
+Vector3 ClosestPointOnTriangle(const Vector3& p, const Vector3& a, const Vector3& b, const Vector3& c)
+{
+    // Voronoi region tests, from Ericson's Real-Time Collision Detection 5.1.5.
+    const Vector3 ab = b - a;
+    const Vector3 ac = c - a;
+    const Vector3 ap = p - a;
+    
+    const auto d1 = ab.dot(ap);
+    const auto d2 = ac.dot(ap);
+    
+    if (d1 <= 0.0 && d2 <= 0.0)
+        return a;
+    
+    const Vector3 bp = p - b;
+    
+    const auto d3 = ab.dot(bp);
+    const auto d4 = ac.dot(bp);
+    
+    if (d3 >= 0.0 && d4 <= d3)
+        return b;
+    
+    const auto vc = d1 * d4 - d3 * d2;
+    
+    if (vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0)
+        return a + ab * (d1 / (d1 - d3));
+    
+    const Vector3 cp = p - c;
+    
+    const auto d5 = ab.dot(cp);
+    const auto d6 = ac.dot(cp);
+    
+    if (d6 >= 0.0 && d5 <= d6)
+        return c;
+    
+    const auto vb = d5 * d2 - d1 * d6;
+    
+    if (vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0)
+        return a + ac * (d2 / (d2 - d6));
+    
+    const auto va = d3 * d6 - d5 * d4;
+    
+    if (va <= 0.0 && (d4 - d3) >= 0.0 && (d5 - d6) >= 0.0)
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    
+    const auto denom = 1.0 / (va + vb + vc);
+    
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
@@ -0,0 +1,67 @@
+//
+//  TriangleBVH.h
+//  Deform
+//
+//  Bounding volume hierarchy over the triangles of a FaceGeometry, for
+//  closest point on surface queries. Nodes are stored depth first in one
+//  array, so the left child of a node is the next node, and leaves
+//  reference contiguous runs of triangles.
+//
+
+#ifndef TriangleBVH_h
+#define TriangleBVH_h
+
+#include "FaceGeometry.h"
+#include "Matrix.h"
+
+#include <vector>
+
+class TriangleBVH
+{
+public:
+    struct Hit
+    {
+        int face;
+        Vector3 point;
+        double distanceSqr;
+    };
+    
+    void build(const FaceGeometry& geometry);
+    
+    size_t numFaces() const { return _triangles.size(); }
+    
+    // Closest point to p on a triangle whose normal faces n, (normal . n) > 0.
+    // A zero n accepts every triangle. Safe to call from several threads.
+    bool closest(const Vector3& p, const Vector3& n, Hit& hit) const;
+    
+private:
+    struct Node
+    {
+        Vector3 min;
+        Vector3 max;
+        
+        // Leaves have count > 0 and cover _triangles[start, start + count).
+        // Inner nodes have count == 0 and their right child at start.
+        int start;
+        int count;
+    };
+    
+    struct Triangle
+    {
+        Vector3 a;
+        Vector3 b;
+        Vector3 c;
+        Vector3 normal;
+        int face;
+    };
+    
+    std::vector<Node> _nodes;
+    std::vector<Triangle> _triangles;
+    
+    int buildNode(std::vector<Vector3>& centroids, int start, int count);
+};
+
+// Closest point to p on triangle abc.
+Vector3 ClosestPointOnTriangle(const Vector3& p, const Vector3& a, const Vector3& b, const Vector3& c);
+
+#endif /* TriangleBVH_h */
@@ -11,14 +11,30 @@
 #include "CorrespondenceUtil.h"
 
 #include "../Timing.h"
+#include "../Parallel.h"
+#include "../NormalEquations.h"
+#include "../Serialize.h"
+#include "../Util.h"
 
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 
 #define INVALID ((unsigned int)-1)
 
+// "DTCP", bump the version whenever the checkpoint layout changes.
+static const uint32_t CheckpointMagic = 0x50435444;
+static const uint32_t CheckpointVersion = 2;
+
 CorrespondenceSolver::CorrespondenceSolver()
 : SolverBase()
+, _adaptive(false)
+, _schedule(DefaultSchedule())
+, _warmStart(false)
+, _surfaceClosest(false)
+, _analyzed(false)
 {
     // Default weights as described in the paper.
     _weights = {
@@ -48,6 +64,8 @@ bool CorrespondenceSolver::setSourceReference(MeshPtr mesh)
     
     CorrespondenceUtil::BuildAdjacency(_source, _faceAdjacency);
     
+    _sourceGeometry.build(*_source);
+    
     _invSurface.resize(_source->n_faces());
     
     _es.resize(_source->n_faces());
@@ -68,35 +86,47 @@ bool CorrespondenceSolver::setTargetReference(MeshPtr mesh)
     _search.setMesh(_target);
     _search.addVertices();
     
+    FaceGeometry targetGeometry;
+    targetGeometry.build(*_target);
+    
+    _targetBVH.build(targetGeometry);
+    
+    std::cout << "Search - Triangles: " << _targetBVH.numFaces() << std::endl;
+    
     return true;
 }
 
 bool CorrespondenceSolver::setVertexConstraints(ConstraintMapPtr map)
 {
-    _anchorMap = map;
-    
-    if (_anchorMap == nullptr)
+    if (map == nullptr)
         return false;
     
     std::cout
         << "Vertex Constraints:" << std::endl
-        << "\tConstrained: " << _anchorMap->size() << std::endl
-        << "\tFree: " << (_source->n_vertices() - _anchorMap->size()) << std::endl;
+        << "\tConstrained: " << map->size() << std::endl
+        << "\tFree: " << (_source->n_vertices() - map->size()) << std::endl;
+    
+    _anchors.assign(_source->n_vertices(), Mesh::Point(0, 0, 0));
+    _vertexMap.assign(_source->n_vertices(), 0);
+    
+    for (const auto& anchor : *map)
+    {
+        if (anchor.first >= _source->n_vertices())
+            continue;
+        
+        _anchors[anchor.first] = anchor.second;
+        _vertexMap[anchor.first] = INVALID;
+    }
     
-    _vertexMap.resize(_source->n_vertices());
     _freeVertices = 0;
     
     for (auto i = 0; i < _source->n_vertices(); i++)
     {
-        if (_anchorMap->find(i) == _anchorMap->end())
+        if (_vertexMap[i] != INVALID)
         {
             _vertexMap[i] = _freeVertices;
             _freeVertices++;
         }
-        else
-        {
-            _vertexMap[i] = INVALID;
-        }
     }
     
     return true;
@@ -105,6 +135,32 @@ bool CorrespondenceSolver::setVertexConstraints(ConstraintMapPtr map)
 void CorrespondenceSolver::setWeights(const std::vector<Weights>& weights)
 {
     _weights = weights;
+    _adaptive = false;
+}
+
+void CorrespondenceSolver::setSchedule(const Schedule& schedule)
+{
+    _schedule = schedule;
+    _adaptive = true;
+}
+
+CorrespondenceSolver::Schedule CorrespondenceSolver::DefaultSchedule()
+{
+    Schedule schedule;
+    
+    schedule.smooth = 1.0;
+    schedule.identity = 0.001;
+    
+    schedule.closestStart = 1.0;
+    schedule.closestGrowth = 10.0;
+    schedule.closestMax = 5000.0;
+    
+    schedule.maxSteps = 8;
+    
+    schedule.displacementThreshold = 0.0005;
+    schedule.residualThreshold = 0.0005;
+    
+    return schedule;
 }
 
 void CorrespondenceSolver::setStepCallback(StepCallback callback)
@@ -112,48 +168,135 @@ void CorrespondenceSolver::setStepCallback(StepCallback callback)
     _stepCallback = callback;
 }
 
+void CorrespondenceSolver::setCheckpoint(const std::string& path)
+{
+    _checkpointPath = path;
+}
+
+void CorrespondenceSolver::setWarmStart(bool warmStart)
+{
+    _warmStart = warmStart;
+}
+
+void CorrespondenceSolver::setSurfaceClosest(bool surface)
+{
+    _surfaceClosest = surface;
+}
+
+void CorrespondenceSolver::setSearchEngine(Search::Engine engine)
+{
+    _search.setEngine(engine);
+}
+
 bool CorrespondenceSolver::resolve()
 {
-    for (auto step = 0; step < _weights.size(); step++)
+    // Every step shares one pattern, it is analyzed by the first solve.
+    _analyzed = false;
+    
+    // No guess for the first step.
+    _x.resize(0, 0);
+    
+    constructPattern();
+    
+    // Thresholds of the adaptive schedule are relative to the target's size.
+    Mesh::Point min, max;
+    Bounds(*_target, min, max);
+    
+    const auto diagonal = (max - min).norm();
+    
+    std::vector<Mesh::Point> previous(_source->n_vertices());
+    
+    Weights weights;
+    
+    auto step = 0;
+    auto done = false;
+    
+    uint64_t key = 0;
+    
+    // The key covers the undeformed source, so it is taken before any step.
+    if (!_checkpointPath.empty())
     {
-        const auto& weights = _weights[step];
+        key = checkpointKey();
         
+        if (!loadCheckpoint(_checkpointPath, key, step, done))
+        {
+            step = 0;
+            done = false;
+        }
+    }
+    
+    for (; !done && stepWeights(step, weights); step++)
+    {
         std::cout << std::endl
         << "Resolve Step [" << step << "]" << std::endl
             << "\tSmoothness:" << weights.smooth << std::endl
             << "\tIdentity:" << weights.identity << std::endl
             << "\tClosest:" << weights.closest << std::endl;
         
-        resetSolve();
-        
         TIMER_START(ConstructProblem);
         
+        resetSolve();
+        
         if (weights.closest == 0)
             solveSI(weights);
         else
             solveSIC(weights);
         
-        _A.setFromTriplets(_m.begin(), _m.end());
+        // Only coordinate 0 is accumulated, every coordinate shares its blocks.
+        ReplicateNormalCoordinate(_AtA, 3);
         
         TIMER_END(ConstructProblem);
         
         TIMER_START(Solve);
         
-        solve(_A, _c, _x);
+        solve(_AtA, _AtC, _x);
         
         TIMER_END(Solve);
         
+        for (auto i = 0; i < _source->n_vertices(); i++)
+            previous[i] = _source->point(_source->vertex_handle(i));
+        
         TIMER_START(CopyToMesh);
         
         copyTo(_x, *_source);
         
         TIMER_END(CopyToMesh);
         
+        const auto displacement = maxDisplacement(previous) / diagonal;
+        
+        std::cout
+            << "Step Residuals" << std::endl
+            << "\tMax Displacement: " << displacement << std::endl;
+        
+        auto converged = false;
+        
+        // Closest point distances are only known for steps that searched them.
+        if (weights.closest != 0)
+        {
+            const auto residual = closestResidual() / diagonal;
+            
+            std::cout << "\tClosest RMS: " << residual << std::endl;
+            
+            // Steps below closestMax move little because their closest weight is
+            // low, not because the fit has settled, so they never converge.
+            converged = weights.closest >= _schedule.closestMax
+                && (displacement < _schedule.displacementThreshold || residual < _schedule.residualThreshold);
+        }
+        
         if (_stepCallback)
             _stepCallback(step, _source);
+        
+        if (!_checkpointPath.empty())
+            saveCheckpoint(_checkpointPath, key, step + 1, weights, _adaptive && converged);
+        
+        if (_adaptive && converged)
+        {
+            std::cout << "Converged after " << (step + 1) << " steps" << std::endl;
+            break;
+        }
     }
     
-    if (_weights.empty())
+    if (step == 0)
         std::cout << "Solving skipped..." << std::endl;
     
     constructCorrespondence();
@@ -166,66 +309,364 @@ const Correspondence& CorrespondenceSolver::faceCorrespondence() const
     return _faceCorr;
 }
 
-void CorrespondenceSolver::resetSolve()
+bool CorrespondenceSolver::stepWeights(int step, Weights& weights) const
 {
-    _row = 0;
+    if (!_adaptive)
+    {
+        if (step >= _weights.size())
+            return false;
+        
+        weights = _weights[step];
+        return true;
+    }
+    
+    if (step >= _schedule.maxSteps)
+        return false;
+    
+    weights.smooth = _schedule.smooth;
+    weights.identity = _schedule.identity;
+    weights.closest = 0;
+    
+    if (step > 0)
+        weights.closest = std::min(_schedule.closestMax, _schedule.closestStart * std::pow(_schedule.closestGrowth, step - 1));
+    
+    return true;
 }
 
-void CorrespondenceSolver::solveSI(const Weights& weights)
+uint64_t CorrespondenceSolver::checkpointKey() const
 {
-    const auto rowSize = 9 * (_faceAdjacency.numPairs() + _source->n_faces());
-    const auto colSize = 3 * (_freeVertices + _source->n_faces());
+    Hasher hasher;
+    
+    hasher.add(CheckpointVersion);
+    hasher.add((uint64_t)_source->n_vertices());
+    hasher.add((uint64_t)_source->n_faces());
+    hasher.add((uint64_t)_target->n_vertices());
+    
+    for (auto i = 0; i < _source->n_vertices(); i++)
+    {
+        const auto& p = _source->point(_source->vertex_handle(i));
+        
+        hasher.add(p[0]);
+        hasher.add(p[1]);
+        hasher.add(p[2]);
+        
+        hasher.add(_vertexMap[i]);
+        
+        if (isAnchored(i))
+        {
+            hasher.add(_anchors[i][0]);
+            hasher.add(_anchors[i][1]);
+            hasher.add(_anchors[i][2]);
+        }
+    }
+    
+    Mesh::VertexHandle vertices[3];
+    
+    for (auto i = 0; i < _source->n_faces(); i++)
+    {
+        FaceVertices(*_source, _source->face_handle(i), vertices);
+        
+        for (int j = 0; j < 3; j++)
+            hasher.add(vertices[j].idx());
+    }
+    
+    for (auto i = 0; i < _target->n_vertices(); i++)
+    {
+        const auto& p = _target->point(_target->vertex_handle(i));
+        
+        hasher.add(p[0]);
+        hasher.add(p[1]);
+        hasher.add(p[2]);
+    }
+    
+    hasher.add(_adaptive);
+    hasher.add(_surfaceClosest);
+    
+    if (_adaptive)
+    {
+        // Field by field, the struct has padding.
+        hasher.add(_schedule.smooth);
+        hasher.add(_schedule.identity);
+        hasher.add(_schedule.closestStart);
+        hasher.add(_schedule.closestGrowth);
+        hasher.add(_schedule.closestMax);
+        hasher.add(_schedule.maxSteps);
+        hasher.add(_schedule.displacementThreshold);
+        hasher.add(_schedule.residualThreshold);
+    }
+    else
+        hasher.add(_weights.data(), _weights.size() * sizeof(Weights));
+    
+    return hasher.value();
+}
+
+bool CorrespondenceSolver::loadCheckpoint(const std::string& path, uint64_t key, int& step, bool& done)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open())
+    {
+        std::cout << "No Checkpoint: " << path << std::endl;
+        return false;
+    }
+    
+    uint32_t magic, version;
+    uint64_t fileKey;
+    
+    if (!ReadValue(in, magic) || !ReadValue(in, version) || !ReadValue(in, fileKey)
+        || magic != CheckpointMagic || version != CheckpointVersion || fileKey != key)
+    {
+        std::cout << "Stale Checkpoint: " << path << std::endl;
+        return false;
+    }
+    
+    int32_t fileStep;
+    bool fileDone;
+    Weights weights;
+    std::vector<double> points;
+    
+    if (!ReadValue(in, fileStep) || !ReadValue(in, fileDone) || !ReadValue(in, weights) || !ReadArray(in, points, _source->n_vertices() * 3)
+        || points.size() != _source->n_vertices() * 3)
+    {
+        std::cerr << "Failed to read Checkpoint: " << path << std::endl;
+        return false;
+    }
+    
+    for (auto i = 0; i < _source->n_vertices(); i++)
+        _source->point(_source->vertex_handle(i)) = Mesh::Point(points[i * 3], points[i * 3 + 1], points[i * 3 + 2]);
+    
+    step = fileStep;
+    done = fileDone;
     
     std::cout
-        << "Solving Smoothness+Identity" << std::endl
-        << "\tProblem Size: " << rowSize << " x " << colSize << " :: " << colSize << " x 1" << std::endl;
+        << "Loaded Checkpoint: " << path << std::endl
+        << "\tCompleted Steps: " << step << (done ? " (Converged)" : "") << std::endl
+        << "\tLast Weights: " << weights.smooth << ", " << weights.identity << ", " << weights.closest << std::endl;
     
-    //_m.reserve(rowSize * colSize);
-    _m.clear();
+    return true;
+}
+
+bool CorrespondenceSolver::saveCheckpoint(const std::string& path, uint64_t key, int step, const Weights& weights, bool done) const
+{
+    // Written next to the checkpoint and renamed, so pre-emption never leaves a partial file.
+    const auto tempPath = path + ".tmp";
     
-    _A.resize(rowSize, colSize);
-    _A.setZero();
+    std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+    if (!out.is_open())
+    {
+        std::cerr << "Failed to open Checkpoint: " << tempPath << std::endl;
+        return false;
+    }
     
-    _c.resize(rowSize, 1);
-    _c.setZero();
+    std::vector<double> points(_source->n_vertices() * 3);
     
-    constructInvSurfaces(*_source, _invSurface);
-    constructECs(*_source, *_target);
+    for (auto i = 0; i < _source->n_vertices(); i++)
+    {
+        const auto& p = _source->point(_source->vertex_handle(i));
+        
+        points[i * 3] = p[0];
+        points[i * 3 + 1] = p[1];
+        points[i * 3 + 2] = p[2];
+    }
     
-    // Es + Ei
-    appendSmoothness(weights.smooth, _m, _c);
-    appendIdentity(weights.identity, _m, _c);
+    const auto success =
+        WriteValue(out, CheckpointMagic)
+        && WriteValue(out, CheckpointVersion)
+        && WriteValue(out, key)
+        && WriteValue(out, (int32_t)step)
+        && WriteValue(out, done)
+        && WriteValue(out, weights)
+        && WriteVector(out, points);
+    
+    out.close();
+    
+#ifdef _WIN32
+    // rename does not replace an existing file on Windows. Pre-emption between
+    // the remove and the rename loses the checkpoint, and the next resolve starts over.
+    if (success)
+        std::remove(path.c_str());
+#endif
+    
+    if (!success || std::rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        std::cerr << "Failed to write Checkpoint: " << path << std::endl;
+        
+        std::remove(tempPath.c_str());
+        
+        return false;
+    }
+    
+    std::cout << "Saved Checkpoint: " << path << std::endl;
+    
+    return true;
 }
 
-void CorrespondenceSolver::solveSIC(const Weights& weights)
+double CorrespondenceSolver::maxDisplacement(const std::vector<Mesh::Point>& previous) const
+{
+    auto displacement = 0.0;
+    
+    for (auto i = 0; i < _source->n_vertices(); i++)
+        displacement = std::max(displacement, (_source->point(_source->vertex_handle(i)) - previous[i]).norm());
+    
+    return displacement;
+}
+
+double CorrespondenceSolver::closestResidual() const
 {
-    const auto rowSize = 9 * (_faceAdjacency.numPairs() + _source->n_faces()) + (3 * _freeVertices);
-    const auto colSize = 3 * (_freeVertices + _source->n_faces());
+    auto sum = 0.0;
+    auto count = 0;
+    
+    for (auto i = 0; i < _source->n_vertices(); i++)
+    {
+        if (isAnchored(i) || !_hasClosest[i])
+            continue;
+        
+        sum += (_source->point(_source->vertex_handle(i)) - _closestPoints[i]).sqrnorm();
+        count++;
+    }
+    
+    return count > 0 ? std::sqrt(sum / count) : 0.0;
+}
+
+void CorrespondenceSolver::constructPattern()
+{
+    const auto numFaces = _source->n_faces();
+    const auto numNodes = _freeVertices + numFaces;
+    
+    _faceIndices.resize(numFaces * 4);
+    
+    ParallelFor(numFaces, _threads,
+    [this]
+    (size_t tri)
+    {
+        vertexIndices(*_source, _source->face_handle((int)tri), &_faceIndices[tri * 4]);
+    });
+    
+    // The identity term couples the unknowns of each face, the smoothness
+    // term those of adjacent faces. Closest points only add to the diagonal.
+    std::vector<std::vector<unsigned int>> adjacency(numNodes);
+    
+    auto couple = [this, &adjacency](int a, int b)
+    {
+        const auto indicesA = &_faceIndices[a * 4];
+        const auto indicesB = &_faceIndices[b * 4];
+        
+        for (int j = 0; j < 4; j++)
+        {
+            if (indicesA[j] == INVALID)
+                continue;
+            
+            auto& adj = adjacency[indicesA[j] / 3];
+            
+            for (int k = 0; k < 4; k++)
+            {
+                if (indicesB[k] != INVALID)
+                    adj.push_back(indicesB[k] / 3);
+            }
+        }
+    };
+    
+    for (int tri = 0; tri < numFaces; tri++)
+    {
+        couple(tri, tri);
+        
+        for (auto adjIdx : _faceAdjacency.get(tri))
+        {
+            couple(tri, adjIdx);
+            couple(adjIdx, tri);
+        }
+    }
+    
+    BuildNormalPattern(adjacency, 3, _AtA);
+    
+    // An identity face writes its own unknowns, a smoothness face also those
+    // of its adjacent faces.
+    std::vector<std::vector<unsigned int>> identityNodes(numFaces);
+    std::vector<std::vector<unsigned int>> smoothNodes(numFaces);
+    
+    auto addNodes =
+    [this]
+    (int tri, std::vector<unsigned int>& nodes)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            if (_faceIndices[tri * 4 + j] != INVALID)
+                nodes.push_back(_faceIndices[tri * 4 + j] / 3);
+        }
+    };
+    
+    for (int tri = 0; tri < numFaces; tri++)
+    {
+        addNodes(tri, identityNodes[tri]);
+        
+        auto& nodes = smoothNodes[tri];
+        
+        if (_faceAdjacency.get(tri).empty())
+            continue;
+        
+        addNodes(tri, nodes);
+        
+        for (auto adjIdx : _faceAdjacency.get(tri))
+            addNodes(adjIdx, nodes);
+        
+        std::sort(nodes.begin(), nodes.end());
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+    }
+    
+    GroupNormalBlocks(identityNodes, numNodes, _identityGroups);
+    GroupNormalBlocks(smoothNodes, numNodes, _smoothGroups);
     
     std::cout
-        << "Solving Smoothness+Identity+Closest" << std::endl
-        << "\tProblem Size: " << rowSize << " x " << colSize << " :: " << colSize << " x 1" << std::endl;
+        << std::endl
+        << "Constructing AtA" << std::endl
+        << "\tSize: " << _AtA.rows() << " x " << _AtA.cols() << std::endl
+        << "\tNon Zeros: " << _AtA.nonZeros() << std::endl
+        << "\tParallel Groups: " << _smoothGroups.size() << " Smoothness, " << _identityGroups.size() << " Identity" << std::endl;
+}
+
+void CorrespondenceSolver::resetSolve()
+{
+    std::fill(_AtA.valuePtr(), _AtA.valuePtr() + _AtA.nonZeros(), 0.0);
     
-    //_m.reserve(rowSize * colSize);
-    _m.clear();
+    _AtC.resize(_AtA.cols(), 1);
+    _AtC.setZero();
+}
+
+void CorrespondenceSolver::solveSI(const Weights& weights)
+{
+    std::cout
+        << "Solving Smoothness+Identity" << std::endl
+        << "\tProblem Size: " << _AtA.rows() << " x " << _AtA.cols() << " :: " << _AtC.rows() << " x 1" << std::endl;
     
-    _A.resize(rowSize, colSize);
-    _A.setZero();
+    constructInvSurfaces(*_source, _sourceGeometry, _invSurface);
+    constructECs(*_source, *_target);
     
-    _c.resize(rowSize, 1);
-    _c.setZero();
+    // Es + Ei
+    appendSmoothness(weights.smooth, _AtA, _AtC);
+    appendIdentity(weights.identity, _AtA, _AtC);
+}
+
+void CorrespondenceSolver::solveSIC(const Weights& weights)
+{
+    std::cout
+        << "Solving Smoothness+Identity+Closest" << std::endl
+        << "\tProblem Size: " << _AtA.rows() << " x " << _AtA.cols() << " :: " << _AtC.rows() << " x 1" << std::endl;
     
     // from Phase 1
-    constructInvSurfaces(*_source, _invSurface);
+    constructInvSurfaces(*_source, _sourceGeometry, _invSurface);
     constructECs(*_source, *_target);
     
     // Es + Ei
-    appendSmoothness(weights.smooth, _m, _c);
-    appendIdentity(weights.identity, _m, _c);
+    appendSmoothness(weights.smooth, _AtA, _AtC);
+    appendIdentity(weights.identity, _AtA, _AtC);
     
     // Ec
-    CorrespondenceUtil::BuildVertex(_source, _search, _nearestCorr);
-    appendClosest(_nearestCorr, weights.closest, _m, _c);
+    TIMER_START(ClosestPoints);
+    
+    constructClosest();
+    
+    TIMER_END(ClosestPoints);
+    
+    appendClosest(weights.closest, _AtA, _AtC);
 }
 
 float MeshThreshold(MeshPtr a)
@@ -259,7 +700,7 @@ void CorrespondenceSolver::constructCorrespondence()
     _search.setMesh(_source);
     _search.addFaces();
     
-    CorrespondenceUtil::BuildFace(_target, _search, _faceCorr, threshold, _maxCorrespondence, true);
+    CorrespondenceUtil::BuildFace(_target, _search, _faceCorr, threshold, _maxCorrespondence, true, _threads);
     
     std::vector<unsigned int> noCorrespondence;
     
@@ -285,117 +726,178 @@ void CorrespondenceSolver::constructCorrespondence()
     }
 }
 
-void CorrespondenceSolver::appendSmoothness(double weight, TripletList& m, MatrixX& c)
+void CorrespondenceSolver::appendSmoothness(double weight, SparseMatrix& ata, MatrixX& atc)
 {
-    for (int tri = 0; tri < _source->n_faces(); tri++)
+    for (const auto& faces : _smoothGroups)
     {
-        appendSmoothness(_source->face_handle(tri), weight, m, c);
+        ParallelFor(faces.size(), _threads,
+        [this, &faces, weight, &ata, &atc]
+        (size_t i)
+        {
+            appendSmoothness(_source->face_handle((int)faces[i]), weight, ata, atc);
+        });
     }
 }
 
-void CorrespondenceSolver::appendSmoothness(const Mesh::FaceHandle& face, double weight, TripletList& m, MatrixX& c)
+void CorrespondenceSolver::appendSmoothness(const Mesh::FaceHandle& face, double weight, SparseMatrix& ata, MatrixX& atc)
 {
     const auto& adjacent = _faceAdjacency.get(face.idx());
     
+    const auto& face_e = _es[face.idx()];
+    const auto& face_c = _cs[face.idx()];
+    
+    // Each pair's rows are weight * (Ef x - Ea x) = weight * (cf - ca), the
+    // three coordinate blocks of E are identical.
+    Eigen::Matrix<double, 3, 8> e;
+    e.leftCols<4>() = weight * face_e.topRows<3>();
+    
+    unsigned int indices[8];
+    std::copy(&_faceIndices[face.idx() * 4], &_faceIndices[face.idx() * 4] + 4, indices);
+    
     for (auto adjIdx : adjacent)
     {
-        auto row = _row;
-        appendEC(face, weight, m, c);
+        e.rightCols<4>() = -weight * _es[adjIdx].topRows<3>();
+        
+        std::copy(&_faceIndices[adjIdx * 4], &_faceIndices[adjIdx * 4] + 4, indices + 4);
         
-        _row = row;
-        appendEC(_source->face_handle(adjIdx), -weight, m, c);
+        const Eigen::Matrix<double, 8, 8> k = e.transpose() * e;
+        
+        AddNormalBlock<8>(ata, indices, k, 3, 0);
+        
+        const Matrix9x1 c = weight * (face_c - _cs[adjIdx]);
+        
+        for (int coord = 0; coord < 3; coord++)
+        {
+            const Eigen::Matrix<double, 8, 1> v = e.transpose() * c.segment<3>(coord * 3);
+            
+            for (int i = 0; i < 8; i++)
+            {
+                if (indices[i] != INVALID)
+                    atc(indices[i] + coord, 0) += v[i];
+            }
+        }
     }
 }
 
-void CorrespondenceSolver::appendIdentity(double weight, TripletList& m, MatrixX& c)
+void CorrespondenceSolver::appendIdentity(double weight, SparseMatrix& ata, MatrixX& atc)
 {
-    for (int tri = 0; tri < _source->n_faces(); tri++)
+    for (const auto& faces : _identityGroups)
     {
-        appendIdentity(_source->face_handle(tri), weight, m, c);
+        ParallelFor(faces.size(), _threads,
+        [this, &faces, weight, &ata, &atc]
+        (size_t i)
+        {
+            appendIdentity(_source->face_handle((int)faces[i]), weight, ata, atc);
+        });
     }
 }
 
-void CorrespondenceSolver::appendIdentity(const Mesh::FaceHandle& face, double weight, TripletList& m, MatrixX& c)
+void CorrespondenceSolver::appendIdentity(const Mesh::FaceHandle& face, double weight, SparseMatrix& ata, MatrixX& atc)
 {
-    const auto& face_e = _es[face.idx()];
-    const auto& face_c = _cs[face.idx()];
+    const auto indices = &_faceIndices[face.idx() * 4];
     
-    appendEC(face, face_e, face_c + C_Identity, weight, m, c);
-}
-
-void CorrespondenceSolver::appendClosest(const Correspondence& nearest, double weight, TripletList& m, MatrixX& c)
-{
-    for (int vert = 0; vert < _source->n_vertices(); vert++)
+    const Matrix3x4 e = weight * _es[face.idx()].topRows<3>();
+    const Matrix9x1 c = weight * (_cs[face.idx()] + C_Identity);
+    
+    const Eigen::Matrix<double, 4, 4> k = e.transpose() * e;
+    
+    AddNormalBlock<4>(ata, indices, k, 3, 0);
+    
+    for (int coord = 0; coord < 3; coord++)
     {
-        if (_anchorMap->count(vert) > 0)
-            continue;
+        const Vector4 v = e.transpose() * c.segment<3>(coord * 3);
         
-        appendClosest(_source->vertex_handle(vert), nearest, weight, m, c);
+        for (int i = 0; i < 4; i++)
+        {
+            if (indices[i] != INVALID)
+                atc(indices[i] + coord, 0) += v[i];
+        }
     }
 }
 
-void CorrespondenceSolver::appendClosest(const Mesh::VertexHandle& vert, const Correspondence& nearest, double weight, TripletList& m, MatrixX& c)
+void CorrespondenceSolver::constructClosest()
 {
-    const auto idx = (int)vertexIndex(vert);
+    const auto numVertices = _source->n_vertices();
     
-    const auto nearestVert = _target->vertex_handle(nearest.get(vert.idx())[0]);
-    const auto nearestP = _target->point(nearestVert);
+    _closestPoints.resize(numVertices);
+    _hasClosest.assign(numVertices, 0);
     
-    m.push_back(Triplet{_row, idx, weight});
-    c(_row, 0) += weight * nearestP[0];
-    _row++;
+    if (!_surfaceClosest)
+    {
+        CorrespondenceUtil::BuildVertex(_source, _search, _nearestCorr, -1.0, -1, false, _threads);
+        
+        for (auto i = 0; i < numVertices; i++)
+        {
+            if (!_nearestCorr.has(i))
+                continue;
+            
+            _closestPoints[i] = _target->point(_target->vertex_handle(_nearestCorr.get(i)[0]));
+            _hasClosest[i] = 1;
+        }
+        
+        return;
+    }
     
-    m.push_back(Triplet{_row, idx + 1, weight});
-    c(_row, 0) += weight * nearestP[1];
-    _row++;
+    // The normal test compares against the deformed source.
+    _source->update_normals();
     
-    m.push_back(Triplet{_row, idx + 2, weight});
-    c(_row, 0) += weight * nearestP[2];
-    _row++;
+    ParallelFor(numVertices, _threads,
+    [this]
+    (size_t i)
+    {
+        if (isAnchored((unsigned int)i))
+            return;
+        
+        const auto vert = _source->vertex_handle((int)i);
+        
+        TriangleBVH::Hit hit;
+        
+        if (!_targetBVH.closest(toEigen(_source->point(vert)), toEigen(_source->normal(vert)), hit))
+            return;
+        
+        _closestPoints[i] = Mesh::Point(hit.point[0], hit.point[1], hit.point[2]);
+        _hasClosest[i] = 1;
+    });
 }
 
-void CorrespondenceSolver::appendEC(const Mesh::FaceHandle& face, double weight, TripletList& m, MatrixX& c)
+void CorrespondenceSolver::appendClosest(double weight, SparseMatrix& ata, MatrixX& atc)
 {
-    const auto& face_e = _es[face.idx()];
-    const auto& face_c = _cs[face.idx()];
-    
-    appendEC(face, face_e, face_c, weight, m, c);
+    // Each vertex only writes its own diagonal and rows.
+    ParallelFor(_source->n_vertices(), _threads,
+    [this, weight, &ata, &atc]
+    (size_t vert)
+    {
+        if (isAnchored((unsigned int)vert) || !_hasClosest[vert])
+            return;
+        
+        appendClosest(_source->vertex_handle((int)vert), weight, ata, atc);
+    });
 }
 
-void CorrespondenceSolver::appendEC(const Mesh::FaceHandle& face, const Matrix9x4& face_e, const Matrix9x1& face_c, double weight, TripletList& m, MatrixX& c)
+void CorrespondenceSolver::appendClosest(const Mesh::VertexHandle& vert, double weight, SparseMatrix& ata, MatrixX& atc)
 {
-    unsigned int vertIndices[4];
-    vertexIndices(*_source, face, vertIndices);
+    const auto idx = (int)vertexIndex(vert);
     
-    int l_row = 0;
+    const auto& nearestP = _closestPoints[vert.idx()];
     
-    if (!face_c.isZero())
-    {
-        c.block<9, 1>(_row, 0) += (weight * face_c);
-    }
+    // One row per coordinate, weight * x = weight * p.
+    const auto w2 = weight * weight;
     
-    for (int coord = 0; coord < 3; coord++)
-    {
-        for (int eqn = 0; eqn < 3; eqn++, _row++, l_row++)
-        {
-            for (int vert = 0; vert < 4; vert++)
-            {
-                const int idx = (int)vertIndices[vert];
-                if (idx != INVALID)
-                {
-                    m.push_back(Triplet{_row, idx + coord, weight * face_e(l_row, vert)});
-                }
-            }
-        }
-    }
+    ata.coeffRef(idx, idx) += w2;
+    
+    atc(idx, 0) += w2 * nearestP[0];
+    atc(idx + 1, 0) += w2 * nearestP[1];
+    atc(idx + 2, 0) += w2 * nearestP[2];
 }
 
 void CorrespondenceSolver::constructECs(const Mesh& source, const Mesh& target)
 {
-    for (int idx = 0; idx < source.n_faces(); idx++)
+    ParallelFor(source.n_faces(), _threads,
+    [this, &source, &target]
+    (size_t idx)
     {
-        constructEC(source, target, source.face_handle(idx), _es[idx], _cs[idx]);
-    }
+        constructEC(source, target, source.face_handle((int)idx), _es[idx], _cs[idx]);
+    });
 }
 
 void CorrespondenceSolver::constructEC(const Mesh& source, const Mesh& target, const Mesh::FaceHandle& face, Matrix9x4& e, Matrix9x1& c)
@@ -426,12 +928,11 @@ void CorrespondenceSolver::constructEC(const Mesh& source, const Mesh& target, c
     {
         const auto vert = *vert_iter;
         
-        auto findIter = _anchorMap->find(vert.idx());
-        if (findIter != _anchorMap->end())
+        if (isAnchored(vert.idx()))
         {
             auto col = e.col(colIdx);
             
-            const auto& p = findIter->second;
+            const auto& p = _anchors[vert.idx()];
             
             v << p[0], p[0], p[0], p[1], p[1], p[1], p[2], p[2], p[2];
             
@@ -445,32 +946,46 @@ void CorrespondenceSolver::constructEC(const Mesh& source, const Mesh& target, c
     }
 }
 
-void CorrespondenceSolver::constructInvSurfaces(const Mesh& mesh, std::vector<Matrix3x3>& invSurfaces)
+void CorrespondenceSolver::constructInvSurfaces(const Mesh& mesh, FaceGeometry& geometry, std::vector<Matrix3x3>& invSurfaces)
 {
-    invSurfaces.resize(mesh.n_faces());
+    // Source positions move every step, the topology cached in geometry does not.
+    geometry.update(mesh);
     
-    for (auto face_iter = mesh.faces_begin(), face_end = mesh.faces_end(); face_iter != face_end; face_iter++)
+    calculateInvSurfaces(geometry, invSurfaces);
+}
+
+bool CorrespondenceSolver::solve(const SparseMatrix& ata, const MatrixX& atc, MatrixX& x)
+{
+    if (!_analyzed)
     {
-        auto face = *face_iter;
+        TIMER_START(Analyze);
+        
+        _solver->analyzePattern(ata);
         
-        calculateInvSurface(mesh, face, invSurfaces[face.idx()]);
+        TIMER_END(Analyze);
+        
+        if (!checkSolverError())
+            return false;
+        
+        _analyzed = true;
     }
-}
-
-bool CorrespondenceSolver::solve(SparseMatrix& a, MatrixX& c, MatrixX& x)
-{    
-    a.makeCompressed();
     
-    auto at = a.transpose();
-    auto ata = at * a;
-    auto atc = at * c;
+    TIMER_START(Factorize);
+    
+    _solver->factorize(ata);
     
-    _solver.compute(ata);
+    TIMER_END(Factorize);
     
     if( !checkSolverError())
         return false;
     
-    x = _solver.solve(atc);
+    if (_warmStart && x.rows() == atc.rows())
+        x = _solver->solveWithGuess(atc, x);
+    else
+        x = _solver->solve(atc);
+    
+    if (_solver->iterations() > 0)
+        std::cout << "\tIterations: " << _solver->iterations() << std::endl;
     
     return checkSolverError();
 }
@@ -505,6 +1020,11 @@ unsigned int CorrespondenceSolver::vertexIndex(unsigned int vertIdx) const
     return idx == INVALID ? idx : idx * 3;
 }
 
+bool CorrespondenceSolver::isAnchored(unsigned int vertIdx) const
+{
+    return _vertexMap[vertIdx] == INVALID;
+}
+
 void CorrespondenceSolver::copyTo(const MatrixX& x, Mesh& mesh)
 {
     int logVerts = 3;
@@ -515,10 +1035,9 @@ void CorrespondenceSolver::copyTo(const MatrixX& x, Mesh& mesh)
     {
         const auto vert = *vert_iter;
         
-        auto findIter = _anchorMap->find(vert.idx());
-        if (findIter != _anchorMap->end())
+        if (isAnchored(vert.idx()))
         {
-            mesh.point(vert) = findIter->second;
+            mesh.point(vert) = _anchors[vert.idx()];
         }
         else
         {
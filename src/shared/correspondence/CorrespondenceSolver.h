@@ -12,11 +12,14 @@
 #include "../SolverBase.h"
 
 #include "../Search.h"
+#include "../TriangleBVH.h"
 
 #include "../DenseCorrespondence.h"
 #include "../SingleDenseCorrespondence.h"
 
 #include <functional>
+#include <string>
+#include <cstdint>
 
 class CorrespondenceSolver : public SolverBase
 {
@@ -28,6 +31,27 @@ public:
         double closest;
     };
     
+    // Adaptive resolve schedule. The first step solves smoothness+identity,
+    // then the closest weight starts at closestStart and grows by closestGrowth
+    // per step up to closestMax. Stops after maxSteps, or once a step at
+    // closestMax has its largest vertex displacement or RMS closest point
+    // distance below its threshold. Thresholds are relative to the target's
+    // bounding box diagonal.
+    struct Schedule
+    {
+        double smooth;
+        double identity;
+        
+        double closestStart;
+        double closestGrowth;
+        double closestMax;
+        
+        int maxSteps;
+        
+        double displacementThreshold;
+        double residualThreshold;
+    };
+    
     typedef std::map<size_t, Mesh::Point> ConstraintMap;
     typedef std::shared_ptr<ConstraintMap> ConstraintMapPtr;
     
@@ -41,10 +65,33 @@ public:
     
     bool setVertexConstraints(ConstraintMapPtr map);
     
+    // Fixed schedule, one step per entry. Disables the adaptive schedule.
     void setWeights(const std::vector<Weights>& weights);
     
+    void setSchedule(const Schedule& schedule);
+    
+    static Schedule DefaultSchedule();
+    
     void setStepCallback(StepCallback callback);
     
+    // Path of a binary checkpoint written after every resolve step.
+    // resolve continues from it when it matches the meshes, constraints and
+    // schedule, and starts over otherwise. Empty disables checkpoints.
+    void setCheckpoint(const std::string& path);
+    
+    // Seeds every step after the first with the previous step's solution.
+    // Only iterative solvers use the guess, see LinearSolver::setTolerance.
+    void setWarmStart(bool warmStart);
+    
+    // Closest constraints snap to the nearest point on the target surface,
+    // found with a triangle BVH, or to the nearest target vertex if false.
+    // Target vertices by default.
+    void setSurfaceClosest(bool surface);
+    
+    // Engine of the closest target vertex search, CGAL by default.
+    // Must be set before setTargetReference.
+    void setSearchEngine(Search::Engine engine);
+    
     const Correspondence& faceCorrespondence() const;
     
     bool resolve();
@@ -52,14 +99,23 @@ public:
 private:
     std::vector<Weights> _weights;
     
+    bool _adaptive;
+    Schedule _schedule;
+    
     StepCallback _stepCallback;
     
+    std::string _checkpointPath;
+    
+    bool _warmStart;
+    
     int _maxCorrespondence;
     
     MeshPtr _source;
     MeshPtr _target;
     
-    ConstraintMapPtr _anchorMap;
+    // Anchor positions by vertex index, flattened from the ConstraintMap.
+    // A vertex is anchored when its _vertexMap entry is INVALID.
+    std::vector<Mesh::Point> _anchors;
     
     std::vector<unsigned int> _vertexMap;
     int _freeVertices;
@@ -72,46 +128,78 @@ private:
     
     SingleDenseCorrespondence _nearestCorr;
     
+    bool _surfaceClosest;
+    
+    TriangleBVH _targetBVH;
+    
+    // Closest point of each source vertex for the current step.
+    std::vector<Mesh::Point> _closestPoints;
+    std::vector<unsigned char> _hasClosest;
+    
+    FaceGeometry _sourceGeometry;
+    
     std::vector<Matrix3x3> _invSurface;
     
     std::vector<Matrix9x4> _es;
     std::vector<Matrix9x1> _cs;
     
-    int _row;
+    // Column of coordinate 0 of the four unknowns of each face, INVALID for anchors.
+    std::vector<unsigned int> _faceIndices;
+    
+    // Normal equations, assembled from each term's local blocks without building A.
+    // The pattern is built once per resolve and shared by every step.
+    SparseMatrix _AtA;
+    MatrixX _AtC;
     
-    TripletList _m;
-    SparseMatrix _A;
+    // Faces grouped so that no two faces of a group write the same unknowns,
+    // each group is added in parallel.
+    std::vector<std::vector<unsigned int>> _smoothGroups;
+    std::vector<std::vector<unsigned int>> _identityGroups;
     
-    MatrixX _c;
     MatrixX _x;
     
+    // Whether the solver holds a symbolic factorization of this resolve's pattern.
+    bool _analyzed;
+    
+    bool stepWeights(int step, Weights& weights) const;
+    
+    uint64_t checkpointKey() const;
+    bool loadCheckpoint(const std::string& path, uint64_t key, int& step, bool& done);
+    bool saveCheckpoint(const std::string& path, uint64_t key, int step, const Weights& weights, bool done) const;
+    
+    double maxDisplacement(const std::vector<Mesh::Point>& previous) const;
+    double closestResidual() const;
+    
+    void constructPattern();
     void resetSolve();
+    
     void solveSI(const Weights& weights);
     void solveSIC(const Weights& weights);
     void constructCorrespondence();
     
-    void appendSmoothness(double weight, TripletList& m, MatrixX& c);
-    void appendSmoothness(const Mesh::FaceHandle& face, double weight, TripletList& m, MatrixX& c);
+    void appendSmoothness(double weight, SparseMatrix& ata, MatrixX& atc);
+    void appendSmoothness(const Mesh::FaceHandle& face, double weight, SparseMatrix& ata, MatrixX& atc);
     
-    void appendIdentity(double weight, TripletList& m, MatrixX& c);
-    void appendIdentity(const Mesh::FaceHandle& face, double weight, TripletList& m, MatrixX& c);
+    void appendIdentity(double weight, SparseMatrix& ata, MatrixX& atc);
+    void appendIdentity(const Mesh::FaceHandle& face, double weight, SparseMatrix& ata, MatrixX& atc);
     
-    void appendClosest(const Correspondence& nearest, double weight, TripletList& m, MatrixX& c);
-    void appendClosest(const Mesh::VertexHandle& vert, const Correspondence& nearest, double weight, TripletList& m, MatrixX& c);
+    void constructClosest();
     
-    void appendEC(const Mesh::FaceHandle& face, double weight, TripletList& m, MatrixX& c);
-    void appendEC(const Mesh::FaceHandle& face, const Matrix9x4& face_e, const Matrix9x1& face_c, double weight, TripletList& m, MatrixX& c);
+    void appendClosest(double weight, SparseMatrix& ata, MatrixX& atc);
+    void appendClosest(const Mesh::VertexHandle& vert, double weight, SparseMatrix& ata, MatrixX& atc);
     
     void constructECs(const Mesh& source, const Mesh& target);
     void constructEC(const Mesh& source, const Mesh& target, const Mesh::FaceHandle& face, Matrix9x4& e, Matrix9x1& c);
     
-    void constructInvSurfaces(const Mesh& mesh, std::vector<Matrix3x3>& invSurfaces);
+    void constructInvSurfaces(const Mesh& mesh, FaceGeometry& geometry, std::vector<Matrix3x3>& invSurfaces);
     
     void vertexIndices(const Mesh& mesh, const Mesh::FaceHandle& face, unsigned int indices[]);
     unsigned int vertexIndex(const Mesh::VertexHandle& vert) const;
     unsigned int vertexIndex(unsigned int vertIdx) const;
     
-    bool solve(SparseMatrix& a, MatrixX& c, MatrixX& x);
+    bool isAnchored(unsigned int vertIdx) const;
+    
+    bool solve(const SparseMatrix& ata, const MatrixX& atc, MatrixX& x);
     
     void copyTo(const MatrixX& x, Mesh& mesh);
 };
@@ -9,6 +9,7 @@
 #include "CorrespondenceUtil.h"
 
 #include "../Util.h"
+#include "../Parallel.h"
 
 #include <thread>
 #include <mutex>
@@ -203,96 +204,104 @@ CorrespondenceUtil::ConstraintMapPtr CorrespondenceUtil::BuildConstraints(Corres
     return map;
 }
 
-unsigned int _Build(MeshPtr mesh, Search& search, Correspondence& corr, size_t numItems, std::function<bool(MeshPtr, int, Mesh::Point&, Mesh::Normal&)> get, float threshold = -1.0, int limit = -1, bool defaultToNearest = false, bool mulithread = true)
+unsigned int _Build(MeshPtr mesh, Search& search, Correspondence& corr, size_t numItems, std::function<bool(MeshPtr, int, Mesh::Point&, Mesh::Normal&)> get, float threshold = -1.0, int limit = -1, bool defaultToNearest = false, int threads = 0)
 {
     corr.setSize(numItems);
     
-    int items = 0;
-    std::mutex itemLock;
+    std::vector<Mesh::Point> itemPoints(numItems);
+    std::vector<Mesh::Normal> itemNormals(numItems);
     
-    auto searchOp =
-    [&mesh, &search, &corr, &get, threshold, limit, defaultToNearest, &items, numItems, &itemLock]
-    (int threadId)
+    ParallelFor(numItems, threads,
+    [&mesh, &get, &itemPoints, &itemNormals]
+    (size_t item)
     {
-        int item = 0;
-        
-        Mesh::Point p;
-        Mesh::Normal n;
+        if (!get(mesh, (int)item, itemPoints[item], itemNormals[item]))
+            itemNormals[item] = Mesh::Normal(0, 0, 0);
+    });
+    
+    // Items with a valid normal, queried as one batch. Results are added in
+    // item order, so the correspondence does not depend on the thread count.
+    std::vector<int> items;
+    std::vector<Mesh::Point> points;
+    std::vector<Mesh::Normal> normals;
+    
+    for (auto item = 0; item < numItems; item++)
+    {
+        if (isZero(itemNormals[item]))
+        {
+            std::cerr << "**Invalid Normal - Item " << item << std::endl;
+            continue;
+        }
         
-        Search::Results results;
-        Search::Result nearest;
+        items.push_back(item);
+        points.push_back(itemPoints[item]);
+        normals.push_back(itemNormals[item]);
+    }
+    
+    Search::Context context;
+    Search::Results nearest;
+    
+    if (threshold <= 0 && limit <= 1)
+    {
+        search.getNearestBatch(points, normals, nearest, threads, &context);
         
-        Search::Context context;
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            if (nearest[i].idx != -1)
+                corr.add(items[i], nearest[i].idx);
+        }
+    }
+    else
+    {
+        std::vector<Search::Results> ranges;
+        search.getRangeBatch(points, normals, threshold, ranges, threads, &context, limit);
         
-        bool nearestSearch = threshold <= 0 && limit <= 1;
+        // Items without a hit in range, when defaulting to the nearest.
+        std::vector<int> nearestItems;
+        std::vector<Mesh::Point> nearestPoints;
+        std::vector<Mesh::Normal> nearestNormals;
         
-        while(true)
+        for (size_t i = 0; i < items.size(); i++)
         {
-            itemLock.lock();
-            item = items;
-            items++;
-            itemLock.unlock();
+            auto& results = ranges[i];
             
-            if (item >= numItems)
-                break;
-            
-            if (!get(mesh, item, p, n))
-                break;
-            
-            if (isZero(n))
+            if (results.empty())
             {
-                std::cerr << "**Invalid Normal - Item " << item << std::endl;
-                continue;
-            }
-            
-            if (nearestSearch)
-            {
-                if (search.getNearest(p, n, nearest))
-                    corr.add(item, nearest.idx);
-            }
-            else
-            {
-                if (search.getRange(p, n, threshold, results, &context))
-                {
-                    std::sort(results.begin(), results.end(), CompareDistance);
-                    
-                    auto size = (int)results.size();
-                    if (limit > 0)
-                        size = std::min(limit, size);
-                    
-                    auto& c = corr.get(item);
-                    for (int i = 0; i < limit; i++)
-                        c.push_back(results[i].idx);
-                }
-                else
+                if (defaultToNearest)
                 {
-                    if (defaultToNearest)
-                        if (search.getNearest(p, n, nearest))
-                            corr.add(item, nearest.idx);
+                    nearestItems.push_back(items[i]);
+                    nearestPoints.push_back(points[i]);
+                    nearestNormals.push_back(normals[i]);
                 }
+                
+                continue;
             }
+            
+            // Limited ranges come back sorted and clamped.
+            if (limit <= 0)
+                std::sort(results.begin(), results.end(), CompareDistance);
+            
+            auto& c = corr.get(items[i]);
+            for (const auto& result : results)
+                c.push_back(result.idx);
         }
-    };
-    
-    if (mulithread)
-    {
-        std::vector<std::thread> pool;
         
-        for (auto i = 0; i < std::thread::hardware_concurrency(); i++)
-            pool.push_back(std::thread(searchOp, i));
+        search.getNearestBatch(nearestPoints, nearestNormals, nearest, threads, &context);
         
-        for (auto i = 0; i < pool.size(); i++)
-            pool[i].join();
-    }
-    else
-    {
-        searchOp(0);
+        for (size_t i = 0; i < nearestItems.size(); i++)
+        {
+            if (nearest[i].idx != -1)
+                corr.add(nearestItems[i], nearest[i].idx);
+        }
     }
     
+    if (context.visited > 0 && numItems > 0)
+        std::cout << "Search - Visited Nodes: " << (double)context.visited / numItems << " per query" << std::endl;
+    
     return 1;
 }
 
-void CorrespondenceUtil::BuildVertex(MeshPtr mesh, Search& search, Correspondence& corr, float threshold, int limit, bool defaultToNearest)
+void CorrespondenceUtil::BuildVertex(MeshPtr mesh, Search& search, Correspondence& corr, float threshold, int limit, bool defaultToNearest, int threads)
 {
     auto get =
     []
@@ -306,10 +315,10 @@ void CorrespondenceUtil::BuildVertex(MeshPtr mesh, Search& search, Correspondenc
         return true;
     };
     
-    _Build(mesh, search, corr, mesh->n_vertices(), get, threshold, limit, defaultToNearest, false);
+    _Build(mesh, search, corr, mesh->n_vertices(), get, threshold, limit, defaultToNearest, threads);
 }
 
-void CorrespondenceUtil::BuildFace(MeshPtr mesh, Search& search, Correspondence& corr, float threshold, int limit, bool defaultToNearest)
+void CorrespondenceUtil::BuildFace(MeshPtr mesh, Search& search, Correspondence& corr, float threshold, int limit, bool defaultToNearest, int threads)
 {
     auto get =
     []
@@ -323,7 +332,7 @@ void CorrespondenceUtil::BuildFace(MeshPtr mesh, Search& search, Correspondence&
         return true;
     };
     
-    _Build(mesh, search, corr, mesh->n_faces(), get, threshold, limit, defaultToNearest);
+    _Build(mesh, search, corr, mesh->n_faces(), get, threshold, limit, defaultToNearest, threads);
 }
 
 void CorrespondenceUtil::BuildAdjacency(MeshPtr mesh, Correspondence& corr)
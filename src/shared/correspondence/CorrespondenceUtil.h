@@ -26,9 +26,10 @@ public:
     
     static ConstraintMapPtr BuildConstraints(CorrespondencePtr corr, MeshPtr target);
     
-    static void BuildVertex(MeshPtr mesh, Search& search, Correspondence& corr, float threshold = -1.0, int limit = -1, bool defaultToNearest = false);
+    // Queries run in parallel, threads <= 0 uses all cores.
+    static void BuildVertex(MeshPtr mesh, Search& search, Correspondence& corr, float threshold = -1.0, int limit = -1, bool defaultToNearest = false, int threads = 0);
     
-    static void BuildFace(MeshPtr mesh, Search& search, Correspondence& corr, float threshold = -1.0, int limit = -1, bool defaultToNearest = false);
+    static void BuildFace(MeshPtr mesh, Search& search, Correspondence& corr, float threshold = -1.0, int limit = -1, bool defaultToNearest = false, int threads = 0);
     
     static void BuildAdjacency(MeshPtr mesh, Correspondence& corr);
 
@@ -12,13 +12,29 @@
 
 #include "../Util.h"
 
+#include "../Serialize.h"
+#include "../Parallel.h"
+#include "../SurfaceKernels.h"
+#include "../NormalEquations.h"
+
 #include <iostream>
+#include <fstream>
 #include <algorithm>
+#include <cstdio>
+#include <array>
+#include <cmath>
 
 #define INVALID ((unsigned int)-1)
 
+// "DTFC", bump the version whenever the cache layout or the system it stores changes.
+static const uint32_t FactorizationCacheMagic = 0x43465444;
+static const uint32_t FactorizationCacheVersion = 3;
+
 TransferSolver::TransferSolver()
 : SolverBase()
+, _decoupled(false)
+, _condensePhantoms(false)
+, _weldEpsilon(0.0)
 {
 }
 
@@ -26,23 +42,39 @@ TransferSolver::~TransferSolver()
 {
 }
 
+void TransferSolver::setDecoupled(bool decoupled)
+{
+    _decoupled = decoupled;
+}
+
+void TransferSolver::setCondensePhantoms(bool condense)
+{
+    _condensePhantoms = condense;
+}
+
+void TransferSolver::setFactorizationCache(const std::string& path)
+{
+    _cachePath = path;
+}
+
+void TransferSolver::setWeldEpsilon(double epsilon)
+{
+    _weldEpsilon = std::max(0.0, epsilon);
+}
+
 bool TransferSolver::setSourceReference(MeshPtr mesh)
 {
     std::cout
         << "Source Reference" << std::endl
         << "\tVertices: " << mesh->n_vertices() << std::endl
-        << "\tTriangles: " << mesh->n_faces() << std::endl;
+        << "\tTriangles: " << mesh->n_faces() << std::endl
+        << "\tSurface Kernel: " << SurfaceKernelName(DetectSurfaceKernel()) << std::endl;
     
     TIMER_START(CalculateInvVr);
     
-    _invVr.resize(mesh->n_faces());
+    _sourceGeometry.build(*mesh);
     
-    for (auto face_iter = mesh->faces_begin(), face_end = mesh->faces_end(); face_iter != face_end; face_iter++)
-    {
-        const auto face = *face_iter;
-        
-        calculateInvSurface(*mesh, face, _invVr[face.idx()]);
-    }
+    calculateInvSurfaces(_sourceGeometry, _invVr);
     
     TIMER_END(CalculateInvVr);
     
@@ -85,14 +117,10 @@ bool TransferSolver::setSourceDeform(MeshPtr mesh)
     
     TIMER_START(CalculateVd);
     
-    _Vd.resize(mesh->n_faces());
+    // Poses share the reference topology, only positions are refreshed.
+    _sourceGeometry.update(*mesh);
     
-    for (auto face_iter = mesh->faces_begin(), face_end = mesh->faces_end(); face_iter != face_end; face_iter++)
-    {
-        const auto face = *face_iter;
-        
-        calculateSurface(*mesh, face, _Vd[face.idx()]);
-    }
+    calculateSurfaces(_sourceGeometry, _Vd);
     
     TIMER_END(CalculateVd);
     
@@ -147,6 +175,30 @@ bool TransferSolver::setTargetReference(MeshPtr mesh, CorrespondencePtr corr, bo
         _numCorrespondences += std::max(1, (int)corr.size());
     }
     
+    uint64_t key = 0;
+    
+    // Only solvers that can persist their factorization are cached.
+    const auto cached = !_cachePath.empty() && _solver->serializable();
+    
+    if (!_cachePath.empty() && !cached)
+        std::cout << "\tFactorization Cache not supported by solver: " << LinearSolverName(_solver->type()) << std::endl;
+    
+    if (cached)
+    {
+        key = cacheKey(*mesh, buildVertexMap);
+        
+        TIMER_START(LoadFactorization);
+        
+        const auto loaded = loadFactorization(*mesh, _cachePath, key);
+        
+        TIMER_END(LoadFactorization);
+        
+        if (loaded)
+            return checkSolverError();
+    }
+    
+    _vertexMap.clear();
+    
     if (!buildVertexMap)
     {
         _numVertices = mesh->n_vertices();
@@ -155,25 +207,9 @@ bool TransferSolver::setTargetReference(MeshPtr mesh, CorrespondencePtr corr, bo
     {
         TIMER_START(BuildVertexMap);
         
-        _vertexMap.resize(mesh->n_vertices(), INVALID);
-        
         // OpenMesh will fix meshes, duplicating vertices.
         // Create a map to reduce the vertices to only unique vertices.
-        int numDuplicates = 0;
-        for (unsigned int i = 0; i < mesh->n_vertices(); i++)
-        {
-            if (_vertexMap[i] != INVALID)
-                continue;
-            
-            for (int j = i + 1; j < mesh->n_vertices(); j++)
-            {
-                if (mesh->point(mesh->vertex_handle(i)) == mesh->point(mesh->vertex_handle(j)))
-                {
-                    _vertexMap[j] = i;
-                    numDuplicates++;
-                }
-            }
-        }
+        const auto numDuplicates = weldVertices(*mesh);
         
         _numVertices = mesh->n_vertices() - numDuplicates;
         
@@ -185,39 +221,52 @@ bool TransferSolver::setTargetReference(MeshPtr mesh, CorrespondencePtr corr, bo
         TIMER_END(BuildVertexMap);
     }
     
-    TIMER_START(ConstructA);
+    TIMER_START(ConstructAtA);
+    
+    // A is never built, each face's E^T E block is added straight into AtA.
+    constructFaceBlocks(*mesh);
     
-    constructA(*mesh, _A);
+    SparseMatrix AtA;
+    constructAtA(AtA);
     
-    TIMER_END(ConstructA);
+    TIMER_END(ConstructAtA);
     
     TIMER_START(Compute);
     
-    _At = _A.transpose();
-
-    _AtA = _At * _A;
-
-    _solver.compute(_AtA);
+    _solver->compute(AtA);
     
     TIMER_END(Compute);
     
-    return checkSolverError();
+    if (!checkSolverError())
+        return false;
+    
+    if (cached)
+        saveFactorization(_cachePath, key);
+    
+    return true;
 }
 
 bool TransferSolver::deform(MeshPtr targetDeform)
 {
-    TIMER_START(ConstructC);
+    TIMER_START(ConstructAtC);
+    
+    const auto rows = numUnknowns();
+    const auto cols = rhsColumns();
+    
+    std::cout
+        << "Constructing AtC" << std::endl
+        << "\tSize: " << rows << " x " << cols << std::endl;
     
-    MatrixX c;
-    constructC(*targetDeform, c);
+    MatrixX AtC;
+    AtC.setZero(rows, cols);
     
-    TIMER_END(ConstructC);
+    constructAtC(AtC);
     
-    TIMER_START(Solve);
+    TIMER_END(ConstructAtC);
     
-    MatrixX AtC = _At * c;
+    TIMER_START(Solve);
     
-    MatrixX x = _solver.solve(AtC);
+    MatrixX x = _solver->solve(AtC);
     
     TIMER_END(Solve);
     
@@ -233,140 +282,588 @@ bool TransferSolver::deform(MeshPtr targetDeform)
     return true;
 }
 
-void TransferSolver::constructA(const Mesh& mesh, SparseMatrix& a)
+bool TransferSolver::deformBatch(const std::vector<MeshPtr>& sourceDeforms, const std::vector<MeshPtr>& targetDeforms)
 {
-    const auto rows = _numCorrespondences * 9;
-    const auto cols = (_numVertices + mesh.n_faces()) * 3;
+    if (sourceDeforms.size() != targetDeforms.size())
+    {
+        std::cerr << "Batch size mismatch: " << sourceDeforms.size() << " sources, " << targetDeforms.size() << " targets" << std::endl;
+        return false;
+    }
+    
+    if (sourceDeforms.empty())
+        return true;
+    
+    const auto numPoses = sourceDeforms.size();
+    const auto rows = numUnknowns();
+    const auto cols = numPoses * rhsColumns();
     
     std::cout
-        << "Constructing A" << std::endl
-        << "\tSize: " << rows << " x " << cols << std::endl;
+        << "Deform Batch" << std::endl
+        << "\tPoses: " << numPoses << std::endl
+        << "\tAtC Size: " << rows << " x " << cols << std::endl;
     
-    TripletList v;
-    v.reserve(rows * 10);
+    TIMER_START(ConstructBatchAtC);
     
-    Matrix9x4 e;
+    // One column per pose (three when decoupled), Q is rebuilt from each pose's deformed source.
+    MatrixX AtC;
+    AtC.setZero(rows, cols);
     
-    _row = 0;
+    for (size_t pose = 0; pose < numPoses; pose++)
+    {
+        setSourceDeform(sourceDeforms[pose]);
+        
+        constructAtC(AtC, (int)pose * rhsColumns());
+    }
+    
+    TIMER_END(ConstructBatchAtC);
+    
+    TIMER_START(BatchSolve);
     
-    for(uint i = 0; i < mesh.n_faces(); i++)
+    MatrixX x = _solver->solve(AtC);
+    
+    TIMER_END(BatchSolve);
+    
+    if (!checkSolverError())
+        return false;
+    
+    TIMER_START(BatchCopyToMesh);
+    
+    for (size_t pose = 0; pose < numPoses; pose++)
     {
-        const auto face = mesh.face_handle(i);
+        copyTo(x, *targetDeforms[pose], (int)pose * rhsColumns());
+    }
+    
+    TIMER_END(BatchCopyToMesh);
+    
+    return true;
+}
+
+uint64_t TransferSolver::cacheKey(const Mesh& mesh, bool buildVertexMap) const
+{
+    Hasher hasher;
+    
+    hasher.add(FactorizationCacheVersion);
+    hasher.add((uint64_t)mesh.n_vertices());
+    hasher.add((uint64_t)mesh.n_faces());
+    hasher.add(buildVertexMap);
+    hasher.add(_decoupled);
+    hasher.add(_condensePhantoms);
+    hasher.add(buildVertexMap ? _weldEpsilon : 0.0);
+    
+    for (auto i = 0; i < mesh.n_vertices(); i++)
+    {
+        const auto& p = mesh.point(mesh.vertex_handle(i));
         
-        const auto corr = _correspondence->get(i);
-        const auto numCorr = std::max(1, (int)corr.size());
+        hasher.add(p[0]);
+        hasher.add(p[1]);
+        hasher.add(p[2]);
+    }
+    
+    Mesh::VertexHandle vertices[3];
+    
+    for (auto i = 0; i < mesh.n_faces(); i++)
+    {
+        FaceVertices(mesh, mesh.face_handle(i), vertices);
+        
+        for (int j = 0; j < 3; j++)
+            hasher.add(vertices[j].idx());
         
-        constructE(mesh, face, e);
+        const auto& corr = _correspondence->get(i);
         
-        for (int c = 0; c < numCorr; c++)
+        hasher.add((uint64_t)corr.size());
+        hasher.add(corr.data(), corr.size() * sizeof(int));
+    }
+    
+    return hasher.value();
+}
+
+bool TransferSolver::loadFactorization(const Mesh& mesh, const std::string& path, uint64_t key)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open())
+    {
+        std::cout << "\tNo Factorization Cache: " << path << std::endl;
+        return false;
+    }
+    
+    uint32_t magic, version;
+    uint64_t fileKey, numVertices, numCorrespondences;
+    bool decoupled;
+    
+    if (!ReadValue(in, magic) || !ReadValue(in, version) || !ReadValue(in, fileKey)
+        || magic != FactorizationCacheMagic || version != FactorizationCacheVersion || fileKey != key)
+    {
+        std::cout << "\tStale Factorization Cache: " << path << std::endl;
+        return false;
+    }
+    
+    if (!ReadValue(in, decoupled) || !ReadValue(in, numVertices) || !ReadValue(in, numCorrespondences)
+        || decoupled != _decoupled || numCorrespondences != _numCorrespondences || numVertices > mesh.n_vertices())
+    {
+        std::cerr << "Invalid Factorization Cache: " << path << std::endl;
+        return false;
+    }
+    
+    const auto numFaces = mesh.n_faces();
+    
+    auto valid = ReadArray(in, _vertexMap, mesh.n_vertices()) && ReadArray(in, _E, numFaces * 12) && ReadArray(in, _faceIndices, numFaces * 4)
+        && (_vertexMap.empty() || _vertexMap.size() == mesh.n_vertices())
+        && _E.size() == numFaces * 12 && _faceIndices.size() == numFaces * 4;
+    
+    if (valid)
+    {
+        _numVertices = numVertices;
+        
+        const auto size = numUnknowns();
+        
+        // Every stored index must address the restored system.
+        for (auto index : _faceIndices)
         {
-            constructA(mesh, face, e, v);
+            if (index != INVALID && index >= size)
+                valid = false;
         }
+        
+        for (auto index : _vertexMap)
+        {
+            if (index >= _numVertices)
+                valid = false;
+        }
+        
+        valid = valid && _solver->read(in, size);
     }
     
-    _A.resize(rows, cols);
-    _A.setZero();
+    if (!valid)
+    {
+        std::cerr << "Failed to read Factorization Cache: " << path << std::endl;
+        
+        _vertexMap.clear();
+        _E.clear();
+        _faceIndices.clear();
+        
+        return false;
+    }
     
-    _A.setFromTriplets(v.begin(), v.end());
+    std::cout
+        << "\tLoaded Factorization Cache: " << path << std::endl
+        << "\tUnknowns: " << numUnknowns() << std::endl;
     
-    _A.makeCompressed();
+    return true;
 }
 
-void TransferSolver::constructA(const Mesh& mesh, const Mesh::FaceHandle& face, const Matrix9x4& e, TripletList& triplets)
+bool TransferSolver::saveFactorization(const std::string& path, uint64_t key) const
 {
-    unsigned int vertexIdx[4];
-    vertexIndices(mesh, face, vertexIdx);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open())
+    {
+        std::cerr << "Failed to open Factorization Cache: " << path << std::endl;
+        return false;
+    }
     
-    int j_row = 0;
-    for (int coord = 0; coord < 3; coord++)
+    const auto success =
+        WriteValue(out, FactorizationCacheMagic)
+        && WriteValue(out, FactorizationCacheVersion)
+        && WriteValue(out, key)
+        && WriteValue(out, _decoupled)
+        && WriteValue(out, (uint64_t)_numVertices)
+        && WriteValue(out, (uint64_t)_numCorrespondences)
+        && WriteVector(out, _vertexMap)
+        && WriteVector(out, _E)
+        && WriteVector(out, _faceIndices)
+        && _solver->write(out);
+    
+    if (!success)
     {
-        for (int eqn = 0; eqn < 3; eqn++, _row++, j_row++)
-        {
-            for (int vert = 0; vert < 4; vert++)
-            {
-                const int vertIdx = (int)vertexIdx[vert];
-                
-                triplets.push_back(Triplet{_row, vertIdx + coord, e(j_row, vert)});
-            }
-        }
+        std::cerr << "Failed to write Factorization Cache: " << path << std::endl;
+        
+        out.close();
+        std::remove(path.c_str());
+        
+        return false;
     }
+    
+    std::cout << "\tSaved Factorization Cache: " << path << std::endl;
+    
+    return true;
 }
 
-void TransferSolver::constructQ()
+size_t TransferSolver::weldVertices(const Mesh& mesh)
 {
-    if (_invVr.size() != _Vd.size())
-        return;
+    _vertexMap.assign(mesh.n_vertices(), INVALID);
     
-    TIMER_START(ConstructQ);
+    const auto numDuplicates = _weldEpsilon > 0.0 ? weldTolerance(mesh, _weldEpsilon) : weldExact(mesh);
     
-    _Q.resize(_Vd.size());
+    // Welding maps duplicates to their representative, which always has the
+    // lower index. Unique vertices are then numbered 0..numUnique-1 in vertex
+    // order, and duplicates take their representative's number, so vertex
+    // unknowns stay below _numVertices and clear of the phantoms.
+    unsigned int numUnique = 0;
     
-    for (auto i = 0; i < _Vd.size(); i++)
+    for (size_t i = 0; i < _vertexMap.size(); i++)
     {
-        //_Q[i] = _invVr[i] * _Vd[i];
-        //_Q[i].transposeInPlace();
-        
-        calculateQ(_invVr[i], _Vd[i], _Q[i]);
+        if (_vertexMap[i] == INVALID)
+            _vertexMap[i] = numUnique++;
+        else
+            _vertexMap[i] = _vertexMap[_vertexMap[i]];
     }
     
-    TIMER_END(ConstructQ);
+    return numDuplicates;
 }
 
-void TransferSolver::constructC(const Mesh& target, MatrixX& c)
+size_t TransferSolver::weldExact(const Mesh& mesh)
 {
-    const auto rows = _numCorrespondences * 9;
+    // Sort vertex indices by position, equal positions end up adjacent
+    // with the lowest index first, which becomes the representative.
+    std::vector<unsigned int> order;
+    order.reserve(mesh.n_vertices());
     
-    std::cout
-        << "Constructing C" << std::endl
-        << "\tSize: " << rows << " x " << 1 << std::endl;
+    for (unsigned int i = 0; i < mesh.n_vertices(); i++)
+    {
+        if (!isNan(mesh.point(mesh.vertex_handle(i))))
+            order.push_back(i);
+    }
     
-    c.resize(rows, 1);
-    c.setZero();
+    auto less =
+    [&mesh]
+    (unsigned int a, unsigned int b)
+    {
+        const auto& pa = mesh.point(mesh.vertex_handle(a));
+        const auto& pb = mesh.point(mesh.vertex_handle(b));
+        
+        for (int i = 0; i < 3; i++)
+        {
+            if (pa[i] != pb[i])
+                return pa[i] < pb[i];
+        }
+        
+        return a < b;
+    };
+    
+    ParallelSort(order, _threads, less);
     
-    _row = 0;
+    size_t numDuplicates = 0;
     
-    for(auto i = 0; i < target.n_faces(); i++)
+    for (size_t i = 0, rep = 0; i < order.size(); i++)
     {
-        const auto& corr = _correspondence->get(i);
+        const auto& p = mesh.point(mesh.vertex_handle(order[i]));
         
-        if (corr.empty())
+        if (i > 0 && p == mesh.point(mesh.vertex_handle(order[rep])))
         {
-            constructC(C_Identity, c);
+            _vertexMap[order[i]] = order[rep];
+            numDuplicates++;
         }
         else
         {
-            for (auto j = 0; j < corr.size(); j++)
+            rep = i;
+        }
+    }
+    
+    return numDuplicates;
+}
+
+size_t TransferSolver::weldTolerance(const Mesh& mesh, double epsilon)
+{
+    // Bin vertices into a grid of epsilon sized cells, each vertex only
+    // needs to be compared against representatives in the 27 surrounding cells.
+    // Cells are integer coordinates, exact in a double well below 2^63,
+    // so coordinates too large relative to epsilon can't be binned.
+    typedef std::array<int64_t, 3> Cell;
+    
+    const auto maxCell = 9007199254740992.0; // 2^53
+    
+    std::vector<Cell> cells(mesh.n_vertices());
+    std::vector<unsigned char> binned(mesh.n_vertices(), 0);
+    std::vector<unsigned char> overflow(ThreadCount(_threads), 0);
+    
+    ParallelRanges(mesh.n_vertices(), _threads,
+    [&mesh, epsilon, maxCell, &cells, &binned, &overflow]
+    (size_t begin, size_t end, int threadId)
+    {
+        for (auto i = begin; i < end; i++)
+        {
+            const auto& p = mesh.point(mesh.vertex_handle((int)i));
+            
+            if (isNan(p))
+                continue;
+            
+            for (int j = 0; j < 3; j++)
             {
-                const auto corrFaceIdx = corr[j];
+                const auto cell = std::floor(p[j] / epsilon);
                 
-                constructC(_Q[corrFaceIdx], c);
+                if (!(std::abs(cell) < maxCell))
+                {
+                    overflow[threadId] = 1;
+                    return;
+                }
+                
+                cells[i][j] = (int64_t)cell;
+            }
+            
+            binned[i] = 1;
+        }
+    });
+    
+    if (std::find(overflow.begin(), overflow.end(), 1) != overflow.end())
+    {
+        std::cerr << "\tWeld Epsilon " << epsilon << " too small for the mesh extent, welding exact positions" << std::endl;
+        
+        return weldExact(mesh);
+    }
+    
+    // Vertices sorted by cell, and by index within a cell.
+    std::vector<unsigned int> order;
+    order.reserve(mesh.n_vertices());
+    
+    for (unsigned int i = 0; i < mesh.n_vertices(); i++)
+    {
+        if (binned[i])
+            order.push_back(i);
+    }
+    
+    ParallelSort(order, _threads,
+    [&cells]
+    (unsigned int a, unsigned int b)
+    {
+        return cells[a] != cells[b] ? cells[a] < cells[b] : a < b;
+    });
+    
+    // Representatives depend on the ones chosen before them, this pass stays serial.
+    // Each vertex is welded to the lowest representative within epsilon.
+    const auto epsilonSqr = epsilon * epsilon;
+    
+    std::vector<unsigned char> isRep(mesh.n_vertices(), 0);
+    
+    size_t numDuplicates = 0;
+    
+    for (unsigned int i = 0; i < mesh.n_vertices(); i++)
+    {
+        if (!binned[i])
+            continue;
+        
+        const auto& p = mesh.point(mesh.vertex_handle(i));
+        const auto& cell = cells[i];
+        
+        auto rep = INVALID;
+        
+        for (int dx = -1; dx <= 1; dx++)
+        {
+            for (int dy = -1; dy <= 1; dy++)
+            {
+                for (int dz = -1; dz <= 1; dz++)
+                {
+                    const Cell neighbor = {cell[0] + dx, cell[1] + dy, cell[2] + dz};
+                    
+                    auto iter = std::lower_bound(order.begin(), order.end(), neighbor,
+                    [&cells]
+                    (unsigned int a, const Cell& c)
+                    {
+                        return cells[a] < c;
+                    });
+                    
+                    // Only lower indices can be representatives yet.
+                    for (; iter != order.end() && cells[*iter] == neighbor && *iter < i && *iter < rep; ++iter)
+                    {
+                        const auto j = *iter;
+                        
+                        if (isRep[j] && (mesh.point(mesh.vertex_handle(j)) - p).sqrnorm() <= epsilonSqr)
+                            rep = j;
+                    }
+                }
+            }
+        }
+        
+        if (rep != INVALID)
+        {
+            _vertexMap[i] = rep;
+            numDuplicates++;
+        }
+        else
+        {
+            isRep[i] = 1;
+        }
+    }
+    
+    return numDuplicates;
+}
+
+void TransferSolver::constructFaceBlocks(const Mesh& mesh)
+{
+    const auto numFaces = mesh.n_faces();
+    
+    FaceGeometry geometry;
+    geometry.build(mesh);
+    
+    std::vector<Matrix3x3> invS;
+    calculateInvSurfaces(geometry, invS);
+    
+    _E.resize(numFaces * 12);
+    _faceIndices.resize(numFaces * 4);
+    
+    // The three coordinate blocks of e are identical, only the first is kept.
+    ParallelFor(numFaces, _threads,
+    [this, &mesh, &invS]
+    (size_t i)
+    {
+        Matrix9x4 e;
+        constructE(invS[i], e);
+        
+        Eigen::Map<Matrix3x4> block(&_E[i * 12]);
+        block = e.topRows<3>();
+        
+        vertexIndices(mesh, mesh.face_handle((int)i), &_faceIndices[i * 4]);
+    });
+}
+
+void TransferSolver::constructAtA(SparseMatrix& ata) const
+{
+    const auto numFaces = _faceIndices.size() / 4;
+    const auto stride = coordinateStride();
+    const auto numNodes = numUnknowns() / stride;
+    
+    // Every face couples its three vertices and its phantom vertex, if it is kept.
+    std::vector<std::vector<unsigned int>> adjacency(numNodes);
+    std::vector<std::vector<unsigned int>> faceNodes(numFaces);
+    
+    for (size_t i = 0; i < numFaces; i++)
+    {
+        const auto indices = &_faceIndices[i * 4];
+        
+        for (int j = 0; j < 4; j++)
+        {
+            if (indices[j] == INVALID)
+                continue;
+            
+            faceNodes[i].push_back(indices[j] / stride);
+            
+            auto& adj = adjacency[indices[j] / stride];
+            
+            for (int k = 0; k < 4; k++)
+            {
+                if (indices[k] != INVALID)
+                    adj.push_back(indices[k] / stride);
             }
         }
     }
+    
+    BuildNormalPattern(adjacency, stride, ata);
+    
+    adjacency.clear();
+    adjacency.shrink_to_fit();
+    
+    // Faces of a group write disjoint columns, each group is added in parallel.
+    std::vector<std::vector<unsigned int>> groups;
+    GroupNormalBlocks(faceNodes, numNodes, groups);
+    
+    faceNodes.clear();
+    faceNodes.shrink_to_fit();
+    
+    std::cout
+        << "Constructing AtA" << (_decoupled ? " (Decoupled)" : "") << (_condensePhantoms ? " (Condensed)" : "") << std::endl
+        << "\tSize: " << ata.rows() << " x " << ata.cols() << std::endl
+        << "\tNon Zeros: " << ata.nonZeros() << std::endl
+        << "\tParallel Groups: " << groups.size() << std::endl;
+    
+    for (const auto& faces : groups)
+    {
+        ParallelFor(faces.size(), _threads,
+        [this, &faces, &ata, stride]
+        (size_t f)
+        {
+            const auto i = faces[f];
+            
+            const auto numCorr = std::max(1, (int)_correspondence->get((int)i).size());
+            
+            const Eigen::Map<const Matrix3x4> e(&_E[i * 12]);
+            
+            // Each correspondence repeats the face's rows of A.
+            Eigen::Matrix<double, 4, 4> k = numCorr * (e.transpose() * e);
+            
+            // The phantom vertex only appears in this face, so it is eliminated
+            // locally: Kvv - Kvp Kpp^-1 Kpv. Its row and column are skipped below.
+            if (_condensePhantoms && k(3, 3) > 0.0)
+                k.topLeftCorner<3, 3>() -= k.topRightCorner<3, 1>() * k.bottomLeftCorner<1, 3>() / k(3, 3);
+            
+            AddNormalBlock<4>(ata, &_faceIndices[i * 4], k, stride, 0);
+        });
+    }
+    
+    // Only coordinate 0 is accumulated, every coordinate shares its blocks.
+    ReplicateNormalCoordinate(ata, stride);
 }
 
-void TransferSolver::constructC(const Matrix9x1& q, MatrixX& c)
+void TransferSolver::constructAtC(MatrixX& atc, int col) const
 {
-    //c.block<3, 3>(idx * 3, 0) = q;
-    
-//    c.block<3, 1>(idx * 9, 0) += q.row(0);
-//    c.block<3, 1>((idx * 9) + 3, 0) += q.row(1);
-//    c.block<3, 1>((idx * 9) + 6, 0) += q.row(2);
-    
-//    for (int i = 0; i < 3; i++)
-//    {
-//        for (int j = 0; j < 3; j++)
-//        {
-//            c(_row, 0) = q(i, j);
-//            _row++;
-//        }
-//    }
-    
-    c.block<9, 1>(_row, 0) += q;
-    _row += 9;
+    const auto numFaces = _faceIndices.size() / 4;
+    
+    // Each row block of C is one coordinate of a correspondence's Q, multiplied
+    // by the face's E^T and scattered into that coordinate's unknowns.
+    // Coordinates write disjoint entries of atc and run in parallel.
+    ParallelFor(3, _threads,
+    [this, &atc, col, numFaces]
+    (size_t coord)
+    {
+        const auto offset = _decoupled ? 0 : (int)coord;
+        const auto column = _decoupled ? col + (int)coord : col;
+        
+        for (size_t i = 0; i < numFaces; i++)
+        {
+            const auto& corr = _correspondence->get((int)i);
+            
+            const Eigen::Map<const Matrix3x4> e(&_E[i * 12]);
+            const auto indices = &_faceIndices[i * 4];
+            
+            Vector3 c = Vector3::Zero();
+            
+            if (corr.empty())
+            {
+                c = C_Identity.block<3, 1>(coord * 3, 0);
+            }
+            else
+            {
+                for (auto j = 0; j < corr.size(); j++)
+                    c += _Q[corr[j]].block<3, 1>(coord * 3, 0);
+            }
+            
+            Vector4 v = e.transpose() * c;
+            
+            // Matches the Schur complement in constructAtA: rv - Kvp Kpp^-1 rp.
+            // The correspondence count scales Kvp and Kpp alike and cancels.
+            const auto kpp = e.col(3).squaredNorm();
+            
+            if (_condensePhantoms && kpp > 0.0)
+                v.head<3>() -= e.leftCols<3>().transpose() * e.col(3) * (v[3] / kpp);
+            
+            for (int k = 0; k < 4; k++)
+            {
+                if (indices[k] != INVALID)
+                    atc(indices[k] + offset, column) += v[k];
+            }
+        }
+    });
 }
 
-void TransferSolver::copyTo(const MatrixX& x, Mesh& mesh) const
+void TransferSolver::constructQ()
+{
+    if (_invVr.size() != _Vd.size())
+        return;
+    
+    TIMER_START(ConstructQ);
+    
+    _Q.resize(_Vd.size());
+    
+    ParallelFor(_Vd.size(), _threads,
+    [this]
+    (size_t i)
+    {
+        //_Q[i] = _invVr[i] * _Vd[i];
+        //_Q[i].transposeInPlace();
+        
+        calculateQ(_invVr[i], _Vd[i], _Q[i]);
+    });
+    
+    TIMER_END(ConstructQ);
+}
+
+void TransferSolver::copyTo(const MatrixX& x, Mesh& mesh, int col) const
 {
     int logVerts = 3;
     
@@ -378,7 +875,9 @@ void TransferSolver::copyTo(const MatrixX& x, Mesh& mesh) const
         const auto idx = vertexIndex(i);
         
         const auto p = mesh.point(vert);
-        const auto np = OpenMesh::Vec3d(x(idx, 0), x(idx + 1, 0), x(idx + 2, 0));
+        const auto np = _decoupled
+            ? OpenMesh::Vec3d(x(idx, col), x(idx, col + 1), x(idx, col + 2))
+            : OpenMesh::Vec3d(x(idx, col), x(idx + 1, col), x(idx + 2, col));
         
         mesh.point(vert) = np;
         
@@ -390,6 +889,23 @@ void TransferSolver::copyTo(const MatrixX& x, Mesh& mesh) const
     }
 }
 
+size_t TransferSolver::numUnknowns() const
+{
+    const auto numPhantoms = _condensePhantoms ? 0 : _faceIndices.size() / 4;
+    
+    return (_numVertices + numPhantoms) * coordinateStride();
+}
+
+int TransferSolver::coordinateStride() const
+{
+    return _decoupled ? 1 : 3;
+}
+
+int TransferSolver::rhsColumns() const
+{
+    return _decoupled ? 3 : 1;
+}
+
 unsigned int TransferSolver::vertexIndex(const Mesh::VertexHandle& vert) const
 {
     return vertexIndex(vert.idx());
@@ -397,11 +913,9 @@ unsigned int TransferSolver::vertexIndex(const Mesh::VertexHandle& vert) const
 
 unsigned int TransferSolver::vertexIndex(unsigned int idx) const
 {
-    auto vertexIdx = _vertexMap.empty() ? idx : _vertexMap[idx];
-    if (vertexIdx == INVALID)
-        vertexIdx = idx;
+    const auto vertexIdx = _vertexMap.empty() ? idx : _vertexMap[idx];
     
-    return vertexIdx * 3;
+    return vertexIdx * coordinateStride();
 }
 
 void TransferSolver::vertexIndices(const Mesh& mesh, const Mesh::FaceHandle& face, unsigned int vertices[]) const
@@ -412,5 +926,5 @@ void TransferSolver::vertexIndices(const Mesh& mesh, const Mesh::FaceHandle& fac
         vertices[i] = vertexIndex((*vertIter).idx());
     }
     
-    vertices[3] = (unsigned int)(_numVertices + face.idx()) * 3;
+    vertices[3] = _condensePhantoms ? INVALID : (unsigned int)(_numVertices + face.idx()) * coordinateStride();
 }
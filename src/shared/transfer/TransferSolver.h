@@ -13,12 +13,32 @@
 
 #include "../Correspondence.h"
 
+#include <cstdint>
+#include <string>
+
 class TransferSolver : public SolverBase
 {
 public:
     TransferSolver();
     ~TransferSolver();
     
+    // Solve x, y and z as three right-hand sides of one scalar system
+    // instead of one interleaved system. Must be set before setTargetReference.
+    void setDecoupled(bool decoupled);
+    
+    // Eliminate each face's phantom vertex from the system with a local Schur
+    // complement, so only mesh vertices are factored. Must be set before setTargetReference.
+    void setCondensePhantoms(bool condense);
+    
+    // Path of a binary cache for the factored target system.
+    // setTargetReference loads it when it matches the target and correspondence,
+    // and rewrites it otherwise. Empty disables caching.
+    void setFactorizationCache(const std::string& path);
+    
+    // Distance under which target vertices are welded when building the vertex map.
+    // Zero welds only exactly equal positions.
+    void setWeldEpsilon(double epsilon);
+    
     bool setSourceReference(MeshPtr mesh);
     bool setEmptySourceReference(MeshPtr mesh);
     bool setSourceDeform(MeshPtr mesh);
@@ -30,34 +50,59 @@ public:
     
     bool deform(MeshPtr targetDeform);
     
+    // Deform a batch of poses against the current target reference.
+    // All poses share a single At * C product and a single solve.
+    bool deformBatch(const std::vector<MeshPtr>& sourceDeforms, const std::vector<MeshPtr>& targetDeforms);
+    
 private:
     CorrespondencePtr _correspondence;
     
     size_t _numCorrespondences;
     
+    // Compact index of each vertex's unknowns, duplicates share one.
+    // Empty when no vertex map is built.
     std::vector<unsigned int> _vertexMap;
     
     size_t _numVertices;
     
-    int _row;
+    bool _decoupled;
+    
+    bool _condensePhantoms;
+    
+    std::string _cachePath;
+    
+    double _weldEpsilon;
+    
+    FaceGeometry _sourceGeometry;
     
     std::vector<Matrix3x3> _invVr;
     std::vector<Matrix3x3> _Vd;
     std::vector<Matrix9x1> _Q;
     
-    SparseMatrix _A;
-    SparseMatrix _At;
-    SparseMatrix _AtA;
+    // One coordinate block of E per target face (3x4, column-major),
+    // and the column indices of its four unknowns for coordinate 0.
+    std::vector<double> _E;
+    std::vector<unsigned int> _faceIndices;
+    
+    uint64_t cacheKey(const Mesh& mesh, bool buildVertexMap) const;
+    bool loadFactorization(const Mesh& mesh, const std::string& path, uint64_t key);
+    bool saveFactorization(const std::string& path, uint64_t key) const;
+    
+    size_t weldVertices(const Mesh& mesh);
+    size_t weldExact(const Mesh& mesh);
+    size_t weldTolerance(const Mesh& mesh, double epsilon);
     
-    void constructA(const Mesh& mesh, SparseMatrix& a);
-    void constructA(const Mesh& mesh, const Mesh::FaceHandle& face, const Matrix9x4& e, TripletList& triplets);
+    void constructFaceBlocks(const Mesh& mesh);
+    void constructAtA(SparseMatrix& ata) const;
+    void constructAtC(MatrixX& atc, int col = 0) const;
     
     void constructQ();
     
-    void constructC(const Mesh& target, MatrixX& c);
-    void constructC(const Matrix9x1& q, MatrixX& c);
+    void copyTo(const MatrixX& x, Mesh& mesh, int col = 0) const;
     
-    void copyTo(const MatrixX& x, Mesh& mesh) const;
+    size_t numUnknowns() const;
+    int coordinateStride() const;
+    int rhsColumns() const;
     
     unsigned int vertexIndex(const Mesh::VertexHandle& vert) const;
     unsigned int vertexIndex(unsigned int idx) const;
@@ -8,6 +8,9 @@
 #include "../shared/correspondence/CorrespondenceUtil.h"
 
 #include "../shared/SparseCorrespondence.h"
+#include "../shared/FaceGeometry.h"
+#include "../shared/SurfaceKernels.h"
+#include "../shared/TriangleBVH.h"
 
 #include "../shared/Timing.h"
 
@@ -16,6 +19,471 @@
 #include <fstream>
 #include <iomanip>
 #include <filesystem>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <limits>
+
+// n x n quads split into triangles, with a wave in z and an optional twist about y.
+// A seam > 0 duplicates vertex column seam, and the faces right of it use the copy.
+MeshPtr MakeGrid(int n, double twist, int seam = 0)
+{
+    auto mesh = MakeMesh();
+
+    std::vector<Mesh::VertexHandle> vertices;
+    vertices.reserve(n * n);
+
+    for (int j = 0; j < n; j++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            const double x = (double)i / (n - 1);
+            const double y = (double)j / (n - 1);
+            const double z = 0.1 * std::sin(8.0 * x) * std::cos(8.0 * y);
+            const double angle = twist * y;
+
+            vertices.push_back(mesh->add_vertex(Mesh::Point(x * std::cos(angle) - z * std::sin(angle), y, x * std::sin(angle) + z * std::cos(angle))));
+        }
+    }
+
+    std::vector<Mesh::VertexHandle> seamVertices;
+
+    if (seam > 0)
+    {
+        for (int j = 0; j < n; j++)
+            seamVertices.push_back(mesh->add_vertex(mesh->point(vertices[j * n + seam])));
+    }
+
+    auto vertex =
+    [&vertices, &seamVertices, n, seam]
+    (int i, int j, bool right)
+    {
+        return (seam > 0 && right && i == seam) ? seamVertices[j] : vertices[j * n + i];
+    };
+
+    for (int j = 0; j + 1 < n; j++)
+    {
+        for (int i = 0; i + 1 < n; i++)
+        {
+            const auto right = i >= seam;
+
+            const auto v0 = vertex(i, j, right);
+            const auto v1 = vertex(i + 1, j, right);
+            const auto v2 = vertex(i, j + 1, right);
+            const auto v3 = vertex(i + 1, j + 1, right);
+
+            mesh->add_face(v0, v1, v3);
+            mesh->add_face(v0, v3, v2);
+        }
+    }
+
+    return mesh;
+}
+
+// Largest distance between corresponding vertices of two meshes, measured about
+// each mesh's centroid. Transfer solves leave translation free.
+double MaxCentroidError(MeshPtr a, MeshPtr b)
+{
+    auto centroid =
+    []
+    (MeshPtr mesh)
+    {
+        Mesh::Point sum(0, 0, 0);
+
+        for (int i = 0; i < mesh->n_vertices(); i++)
+            sum += mesh->point(mesh->vertex_handle(i));
+
+        return sum / (double)mesh->n_vertices();
+    };
+
+    const auto centroidA = centroid(a);
+    const auto centroidB = centroid(b);
+
+    auto maxError = 0.0;
+
+    for (int i = 0; i < a->n_vertices(); i++)
+    {
+        const auto vert = a->vertex_handle(i);
+
+        maxError = std::max(maxError, (double)((a->point(vert) - centroidA) - (b->point(vert) - centroidB)).norm());
+    }
+
+    return maxError;
+}
+
+// Transfers a twist onto a grid with a duplicated seam, welded, with and without
+// phantom condensation. Condensing eliminates the phantoms exactly, so both must
+// agree.
+bool TestCondensedWeld()
+{
+    const auto n = 16;
+
+    auto sourceRef = MakeGrid(n, 0.0, n / 2);
+    auto sourceDeform = MakeGrid(n, 1.0, n / 2);
+    auto targetRef = MakeGrid(n, 0.0, n / 2);
+
+    auto corr = std::make_shared<DenseCorrespondence>();
+    corr->setSize(targetRef->n_faces());
+
+    for (int i = 0; i < targetRef->n_faces(); i++)
+        corr->add(i, i);
+
+    std::vector<MeshPtr> results;
+
+    for (auto condense : {false, true})
+    {
+        TransferSolver xfer;
+        xfer.setCondensePhantoms(condense);
+        xfer.setSourceReference(sourceRef);
+
+        auto targetDeform = MakeMesh(targetRef);
+
+        if (!xfer.setTargetReference(targetRef, corr, true) || !xfer.setSourceDeform(sourceDeform) || !xfer.deform(targetDeform))
+        {
+            std::cerr << "Condensed Weld Test: solve failed" << std::endl;
+            return false;
+        }
+
+        results.push_back(targetDeform);
+    }
+
+    const auto maxError = MaxCentroidError(results[0], results[1]);
+    const auto success = maxError < 1e-6;
+
+    std::cout << "Condensed Weld Test: " << (success ? "Passed" : "Failed") << " (Max Error " << maxError << ")" << std::endl;
+
+    return success;
+}
+
+// Compares every surface kernel this CPU supports against the scalar kernel, and the
+// scalar inverse against Eigen's. The range starts and ends off a vector boundary so
+// the SIMD paths also hand a remainder to the scalar path.
+bool TestSurfaceKernels()
+{
+    auto mesh = MakeGrid(101, 1.0);
+
+    FaceGeometry geometry;
+    geometry.build(*mesh);
+
+    const size_t begin = 3;
+    const size_t end = geometry.numFaces() - 5;
+    const auto count = end - begin;
+
+    std::vector<Matrix3x3> scalarSurfaces(count), scalarInvSurfaces(count);
+    std::vector<Vector3> scalarPhantoms(count);
+
+    CalculateSurfaces(geometry, begin, end, scalarSurfaces.data(), scalarInvSurfaces.data(), scalarPhantoms.data(), SurfaceKernel::Scalar);
+
+    auto maxError = 0.0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const Matrix3x3 inv = scalarSurfaces[i].inverse();
+
+        maxError = std::max(maxError, (scalarInvSurfaces[i] - inv).norm() / inv.norm());
+    }
+
+    auto success = maxError < 1e-12;
+
+    std::cout << "Surface Kernel Test: Scalar vs Eigen inverse " << (success ? "Passed" : "Failed") << " (Max Relative Error " << maxError << ")" << std::endl;
+
+    for (auto kernel : {SurfaceKernel::AVX2, SurfaceKernel::AVX512})
+    {
+        if ((int)kernel > (int)DetectSurfaceKernel())
+            continue;
+
+        std::vector<Matrix3x3> surfaces(count), invSurfaces(count);
+        std::vector<Vector3> phantoms(count);
+
+        CalculateSurfaces(geometry, begin, end, surfaces.data(), invSurfaces.data(), phantoms.data(), kernel);
+
+        auto kernelError = 0.0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            kernelError = std::max(kernelError, (surfaces[i] - scalarSurfaces[i]).norm() / scalarSurfaces[i].norm());
+            kernelError = std::max(kernelError, (invSurfaces[i] - scalarInvSurfaces[i]).norm() / scalarInvSurfaces[i].norm());
+            kernelError = std::max(kernelError, (phantoms[i] - scalarPhantoms[i]).norm() / scalarPhantoms[i].norm());
+        }
+
+        std::cout << "Surface Kernel Test: " << SurfaceKernelName(kernel) << " vs Scalar " << (kernelError < 1e-12 ? "Passed" : "Failed") << " (Max Relative Error " << kernelError << ")" << std::endl;
+
+        success = success && kernelError < 1e-12;
+    }
+
+    return success;
+}
+
+// Transfers a twist with every solver compiled in and compares each result with
+// the ldlt one. Direct solvers must agree to round-off, cg to its tolerance.
+bool TestSolverAgreement()
+{
+    const auto n = 32;
+
+    auto sourceRef = MakeGrid(n, 0.0);
+    auto sourceDeform = MakeGrid(n, 1.0);
+    auto targetRef = MakeGrid(n, 0.0);
+
+    auto corr = std::make_shared<DenseCorrespondence>();
+    corr->setSize(targetRef->n_faces());
+
+    for (int i = 0; i < targetRef->n_faces(); i++)
+        corr->add(i, i);
+
+    MeshPtr reference;
+    auto success = true;
+
+    for (auto type : {LinearSolverType::LDLT, LinearSolverType::LLT, LinearSolverType::Cholmod, LinearSolverType::CG})
+    {
+        if (!LinearSolverAvailable(type))
+            continue;
+
+        TransferSolver xfer;
+        xfer.setSolver(type);
+        xfer.setSourceReference(sourceRef);
+
+        auto targetDeform = MakeMesh(targetRef);
+
+        if (!xfer.setTargetReference(targetRef, corr) || !xfer.setSourceDeform(sourceDeform) || !xfer.deform(targetDeform))
+        {
+            std::cerr << "Solver Agreement Test: " << LinearSolverName(type) << " solve failed" << std::endl;
+            return false;
+        }
+
+        if (reference == nullptr)
+        {
+            reference = targetDeform;
+            continue;
+        }
+
+        const auto maxError = MaxCentroidError(reference, targetDeform);
+        const auto passed = maxError < (type == LinearSolverType::CG ? 1e-4 : 1e-8);
+
+        std::cout << "Solver Agreement Test: " << LinearSolverName(type) << " vs " << LinearSolverName(LinearSolverType::LDLT) << " " << (passed ? "Passed" : "Failed") << " (Max Error " << maxError << ")" << std::endl;
+
+        success = success && passed;
+    }
+
+    return success;
+}
+
+// Compares TriangleBVH::closest with a scan of every triangle, with and without a
+// query normal. Half the queries sit on grid vertices and edge midpoints, where several
+// triangles tie and the lowest face index must win.
+bool TestTriangleBVH()
+{
+    auto mesh = MakeGrid(64, 1.0);
+
+    FaceGeometry geometry;
+    geometry.build(*mesh);
+
+    TriangleBVH bvh;
+    bvh.build(geometry);
+
+    Mesh::Point min, max;
+    Bounds(*mesh, min, max);
+
+    std::mt19937 random(1);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::normal_distribution<double> normal(0.0, 1.0);
+
+    auto mismatches = 0;
+    const auto numQueries = 1000;
+
+    for (int query = 0; query < numQueries; query++)
+    {
+        Vector3 p;
+
+        if (query % 2 == 0)
+        {
+            const auto a = mesh->point(mesh->vertex_handle(random() % mesh->n_vertices()));
+            const auto b = mesh->point(mesh->vertex_handle(random() % mesh->n_vertices()));
+            const auto point = query % 4 == 0 ? a : (a + b) * 0.5;
+
+            p = Vector3(point[0], point[1], point[2]);
+        }
+        else
+        {
+            for (int i = 0; i < 3; i++)
+                p[i] = min[i] + (max[i] - min[i]) * (1.5 * unit(random) - 0.25);
+        }
+
+        const Vector3 n = query % 3 == 0 ? Vector3::Zero() : Vector3(normal(random), normal(random), normal(random));
+
+        auto bestFace = -1;
+        auto bestDistanceSqr = std::numeric_limits<double>::max();
+
+        for (size_t face = 0; face < geometry.numFaces(); face++)
+        {
+            Vector3 corners[3];
+
+            for (int i = 0; i < 3; i++)
+            {
+                const auto v = geometry.vertex(face, i);
+                corners[i] = Vector3(geometry.x()[v], geometry.y()[v], geometry.z()[v]);
+            }
+
+            const Vector3 faceNormal = (corners[1] - corners[0]).cross(corners[2] - corners[0]).normalized();
+
+            if (!n.isZero() && faceNormal.dot(n) <= 0.0)
+                continue;
+
+            const auto distanceSqr = (ClosestPointOnTriangle(p, corners[0], corners[1], corners[2]) - p).squaredNorm();
+
+            if (distanceSqr < bestDistanceSqr)
+            {
+                bestFace = (int)face;
+                bestDistanceSqr = distanceSqr;
+            }
+        }
+
+        TriangleBVH::Hit hit;
+        const auto found = bvh.closest(p, n, hit);
+
+        if (found != (bestFace != -1) || hit.face != bestFace || (found && hit.distanceSqr != bestDistanceSqr))
+            mismatches++;
+    }
+
+    const auto success = mismatches == 0;
+
+    std::cout << "Triangle BVH Test: " << (success ? "Passed" : "Failed") << " (" << mismatches << " of " << numQueries << " Queries Differ)" << std::endl;
+
+    return success;
+}
+
+// Times the factorization and one deform for every solver compiled in.
+void BenchmarkSolvers(const std::string& name, MeshPtr sourceRef, MeshPtr sourceDeform, MeshPtr targetRef, CorrespondencePtr corr, bool buildVertexMap)
+{
+    std::vector<std::string> results;
+
+    for (auto type : {LinearSolverType::LDLT, LinearSolverType::LLT, LinearSolverType::Cholmod, LinearSolverType::CG})
+    {
+        if (!LinearSolverAvailable(type))
+            continue;
+
+        TransferSolver xfer;
+        xfer.setSolver(type);
+        xfer.setSourceReference(sourceRef);
+
+        const auto start = std::chrono::steady_clock::now();
+
+        auto success = xfer.setTargetReference(targetRef, corr, buildVertexMap);
+
+        const auto factored = std::chrono::steady_clock::now();
+
+        auto targetDeform = MakeMesh(targetRef);
+
+        xfer.setSourceDeform(sourceDeform);
+        success = success && xfer.deform(targetDeform);
+
+        const auto solved = std::chrono::steady_clock::now();
+
+        std::stringstream result;
+        result
+            << "\t" << LinearSolverName(type) << ": "
+            << (success ? "" : "(Failed) ")
+            << "Factor " << std::chrono::duration<double>(factored - start).count() << "s, "
+            << "Deform " << std::chrono::duration<double>(solved - factored).count() << "s, "
+            << "Iterations " << xfer.solver().iterations();
+
+        results.push_back(result.str());
+    }
+
+    std::cout << "Solver Benchmark: " << name << std::endl;
+
+    for (const auto& result : results)
+        std::cout << result << std::endl;
+}
+
+// Times building the vertex and face trees, and one query per vertex and per face,
+// in index order and as a single threaded Morton ordered batch.
+// Build with DEFORM_SEARCH_MAP_POINTS to compare against the map storage.
+void BenchmarkSearch(const std::string& name, MeshPtr mesh, Search::Engine engine, bool normalCones = true)
+{
+    Search search(engine);
+    search.setMesh(mesh);
+    search.setNormalCones(normalCones);
+
+    mesh->request_face_normals();
+    mesh->request_vertex_normals();
+    mesh->update_normals();
+
+    const auto start = std::chrono::steady_clock::now();
+
+    search.addVertices();
+
+    const auto vertexBuilt = std::chrono::steady_clock::now();
+
+    Search::Result nearest;
+    Search::Context nearestContext;
+    auto found = 0;
+
+    for (int i = 0; i < mesh->n_vertices(); i++)
+    {
+        const auto vert = mesh->vertex_handle(i);
+
+        if (search.getNearest(mesh->point(vert), mesh->normal(vert), nearest, &nearestContext))
+            found++;
+    }
+
+    const auto vertexQueried = std::chrono::steady_clock::now();
+
+    search.addFaces();
+
+    const auto faceBuilt = std::chrono::steady_clock::now();
+
+    Mesh::Point min, max;
+    Bounds(*mesh, min, max);
+
+    const auto threshold = (float)std::sqrt(4 * (max - min).sqrnorm() / mesh->n_vertices());
+
+    Search::Results results;
+    Search::Context context;
+    size_t hits = 0;
+
+    for (int i = 0; i < mesh->n_faces(); i++)
+    {
+        const auto face = mesh->face_handle(i);
+
+        search.getRange(mesh->calc_face_centroid(face), mesh->calc_face_normal(face), threshold, results, &context);
+        hits += results.size();
+    }
+
+    const auto faceQueried = std::chrono::steady_clock::now();
+
+    std::vector<Mesh::Point> centroids(mesh->n_faces());
+    std::vector<Mesh::Normal> normals(mesh->n_faces());
+
+    for (int i = 0; i < mesh->n_faces(); i++)
+    {
+        const auto face = mesh->face_handle(i);
+
+        centroids[i] = mesh->calc_face_centroid(face);
+        normals[i] = mesh->calc_face_normal(face);
+    }
+
+    std::vector<Search::Results> batchResults;
+
+    const auto batchStart = std::chrono::steady_clock::now();
+
+    search.getRangeBatch(centroids, normals, threshold, batchResults, 1);
+
+    const auto batchQueried = std::chrono::steady_clock::now();
+
+    std::cout
+        << "Search Benchmark: " << name << " (" << Search::EngineName(engine) << (normalCones ? "" : ", no cones") << ", " << Search::StorageName() << ")" << std::endl
+        << "\tVertex Build " << std::chrono::duration<double>(vertexBuilt - start).count() << "s, "
+        << "Nearest " << std::chrono::duration<double>(vertexQueried - vertexBuilt).count() << "s, "
+        << "Found " << found << ", "
+        << "Visited " << (double)nearestContext.visited / mesh->n_vertices() << std::endl
+        << "\tFace Build " << std::chrono::duration<double>(faceBuilt - vertexQueried).count() << "s, "
+        << "Range " << std::chrono::duration<double>(faceQueried - faceBuilt).count() << "s, "
+        << "Hits " << hits << ", "
+        << "Visited " << (double)context.visited / mesh->n_faces() << ", "
+        << "Batch " << std::chrono::duration<double>(batchQueried - batchStart).count() << "s" << std::endl;
+}
 
 int main(int argc, char* argv[])
 {
@@ -25,6 +493,26 @@ int main(int argc, char* argv[])
     const std::string vertCorrespondencePath = dataPath + "/horse_camel_vert.corr";
     const std::string faceCorrespondencePath = outputPath + "/horse_camel_face.corr";
 
+    std::cout << std::endl << "=Surface Kernel Test=" << std::endl;
+
+    if (!TestSurfaceKernels())
+        return 1;
+
+    std::cout << std::endl << "=Solver Agreement Test=" << std::endl;
+
+    if (!TestSolverAgreement())
+        return 1;
+
+    std::cout << std::endl << "=Triangle BVH Test=" << std::endl;
+
+    if (!TestTriangleBVH())
+        return 1;
+
+    std::cout << std::endl << "=Condensed Weld Test=" << std::endl;
+
+    if (!TestCondensedWeld())
+        return 1;
+
     const auto numPoses = 10;
     const std::string horseDir = dataPath  + "/horse/";
     const std::string horseRefPath = horseDir + "horse-reference.obj";
@@ -35,9 +523,6 @@ int main(int argc, char* argv[])
 
     MeshPtr sourceRef = ReadMesh(horseRefPath, true);
     MeshPtr targetRef = ReadMesh(camelRefPath, true);
-    MeshPtr targetDeform = MakeMesh(targetRef);
-
-    MeshPtr mergedMesh = MakeMesh();
 
     CorrespondenceSolver::ConstraintMapPtr anchorMap = nullptr;
 
@@ -48,7 +533,7 @@ int main(int argc, char* argv[])
         exit(1);
     }
 
-    anchorMap = CorrespondenceUtil::BuildConstraints(vertCorrespondence, targetRef, false);
+    anchorMap = CorrespondenceUtil::BuildConstraints(vertCorrespondence, targetRef);
 
     std::cout << std::endl << "=Correspondence Resolver=" << std::endl;
 
@@ -88,33 +573,81 @@ int main(int argc, char* argv[])
         exit(1);
     }
 
+    // Per-face precomputation scaling, from one thread up to all cores.
+    const int maxThreads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    for (int threads = 1; ; threads = std::min(threads * 2, maxThreads))
+    {
+        std::cout << "Threads: " << threads << std::endl;
+
+        xfer.setThreads(threads);
+        xfer.setSourceReference(sourceRef);
+        xfer.setSourceDeform(sourceRef);
+
+        if (threads == maxThreads)
+            break;
+    }
+
+    xfer.setThreads(0);
+
+    std::vector<MeshPtr> sourceDeforms;
+    std::vector<MeshPtr> targetDeforms;
+
     for (int pose = 1; pose <= numPoses; pose++)
     {
         path.str("");
         path << horseDir << "horse-" << std::setfill('0') << std::setw(2) << pose << ".obj";
 
-        std::cout << "Deforming to " << path.str() << std::endl;
+        std::cout << "Loading " << path.str() << std::endl;
 
-        auto sourceDeform = ReadMesh(path.str());
-
-        xfer.setSourceDeform(sourceDeform);
+        sourceDeforms.push_back(ReadMesh(path.str(), true));
+        targetDeforms.push_back(MakeMesh(targetRef));
+    }
 
-        auto success = xfer.deform(targetDeform);
+    auto success = xfer.deformBatch(sourceDeforms, targetDeforms);
 
-        TIMER_END(Transfer);
+    TIMER_END(Transfer);
 
-        if (!success)
-        {
-            std::cerr << "Failed to transfer deformation" << std::endl;
-            return 1;
-        }
+    if (!success)
+    {
+        std::cerr << "Failed to transfer deformation" << std::endl;
+        return 1;
+    }
 
+    for (int pose = 1; pose <= numPoses; pose++)
+    {
         path.str("");
         path << outputPath << "/camel-" << std::setfill('0') << std::setw(2) << pose << "-deform.obj";
 
-        WriteMesh(path.str(), targetDeform);
+        WriteMesh(path.str(), targetDeforms[pose - 1]);
     }
 
+    std::cout << std::endl << "=Solver Benchmark=" << std::endl;
+
+    BenchmarkSolvers("horse/camel", sourceRef, sourceDeforms[0], targetRef, faceCorrespondence, true);
+
+    // Synthetic target of about 1M faces, matched face to face.
+    auto gridRef = MakeGrid(708, 0.0);
+    auto gridDeform = MakeGrid(708, 1.0);
+
+    auto gridCorrespondence = std::make_shared<DenseCorrespondence>();
+    gridCorrespondence->setSize(gridRef->n_faces());
+
+    for (int i = 0; i < gridRef->n_faces(); i++)
+        gridCorrespondence->add(i, i);
+
+    BenchmarkSolvers("synthetic 1M faces", gridRef, gridDeform, gridRef, gridCorrespondence, false);
+
+    std::cout << std::endl << "=Search Benchmark=" << std::endl;
+
+    for (auto engine : {Search::EngineCGAL, Search::EngineFlat})
+    {
+        BenchmarkSearch("camel", targetRef, engine);
+        BenchmarkSearch("synthetic 1M faces", gridRef, engine);
+    }
+
+    BenchmarkSearch("camel", targetRef, Search::EngineFlat, false);
+
     std::cout << "Complete" << std::endl;
 
     return 0;
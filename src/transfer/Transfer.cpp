@@ -30,6 +30,12 @@ int main(int argc, char* argv[])
         ("v,vertex-corr", "Path to the vertex correspondence file", cxxopts::value<std::string>(), "Vertex or face correspondence must be provided")
         ("f,face-corr", "Path to the face correspondence file", cxxopts::value<std::string>(), "Vertex or face correspondence must be provided")
         ("o,output", "Path to save the deformed target mesh to", cxxopts::value<std::string>())
+        ("decoupled", "Solve x, y and z as separate right-hand sides of one factorization")
+        ("condense", "Eliminate the per-face phantom vertices so only mesh vertices are factored")
+        ("c,cache", "Path to the target factorization cache, created if missing or stale", cxxopts::value<std::string>(), "(Optional)")
+        ("weld-epsilon", "Distance under which duplicate target vertices are welded", cxxopts::value<double>()->default_value("0"))
+        ("j,threads", "Number of threads for per-face work, 0 uses all cores", cxxopts::value<int>()->default_value("0"))
+        ("solver", "Sparse solver: ldlt, llt, cholmod or cg", cxxopts::value<std::string>()->default_value("ldlt"))
         ;
 
     std::string sourceRefPath;
@@ -38,6 +44,12 @@ int main(int argc, char* argv[])
     std::string vertCorrespondencePath;
     std::string faceCorrespondencePath;
     std::string outputPath;
+    std::string cachePath;
+    bool decoupled = false;
+    bool condense = false;
+    double weldEpsilon = 0.0;
+    int threads = 0;
+    LinearSolverType solverType = LinearSolverType::LDLT;
 
     try
     {
@@ -69,6 +81,22 @@ int main(int argc, char* argv[])
         }
 
         outputPath = result["output"].as<std::string>();
+
+        decoupled = result.count("decoupled") > 0;
+        condense = result.count("condense") > 0;
+        weldEpsilon = result["weld-epsilon"].as<double>();
+        threads = result["threads"].as<int>();
+
+        if (!ParseLinearSolverType(result["solver"].as<std::string>(), solverType))
+        {
+            std::cout << "Unknown solver: " << result["solver"].as<std::string>() << std::endl;
+            exit(1);
+        }
+
+        if (result.count("c"))
+        {
+            cachePath = result["cache"].as<std::string>();
+        }
     }
     catch (const cxxopts::OptionException& e)
     {
@@ -138,6 +166,15 @@ int main(int argc, char* argv[])
     
     TransferSolver xfer;
     
+    xfer.setDecoupled(decoupled);
+    xfer.setCondensePhantoms(condense);
+    xfer.setFactorizationCache(cachePath);
+    xfer.setWeldEpsilon(weldEpsilon);
+    xfer.setThreads(threads);
+
+    if (!xfer.setSolver(solverType))
+        exit(1);
+    
     xfer.setSourceReference(sourceRef);
     
     if (!xfer.setTargetReference(targetRef, faceCorrespondence, true))